@@ -0,0 +1,474 @@
+#!/usr/bin/env python3
+
+import argparse
+import fcntl
+import json
+import os
+import random
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# FUSE driver under test
+FUSE_BIN = './sfs'
+
+# SFS filesystem tools (create and inspect images)
+MKFS = './mkfs.sfs'
+FSCK = './fsck.sfs'
+
+# Seconds to wait for the driver to mount, or to answer a statistics request.
+TIMEOUT = 10
+
+# Image contents. Stat is measured at each of these depths; the nested
+# directories are /d1/d2/.../dN, each holding a file "f".
+STAT_DEPTHS = (1, 3, 6)
+
+# Subdirectories hold 16 entries and the root directory 64. /full and the
+# root are filled up completely so readdir has to walk every slot.
+SUBDIR_ENTRIES = 16
+ROOTDIR_ENTRIES = 64
+
+BIG_SIZE = 4 * 1024 * 1024
+SMALL_SIZE = 256 * 1024
+
+READ_CHUNK = 128 * 1024
+RANDREAD_SIZE = 4096
+SMALLWRITE_SIZE = 512
+LARGEWRITE_SIZE = 1024 * 1024
+LARGEWRITE_TOTAL = 2 * 1024 * 1024
+
+# The root directory is full, so the large write file goes next to the churn
+# files, which never use the last slot of /churn.
+LARGEWRITE_PATH = '/churn/wbig'
+
+# In-driver copies of /small (SFS_IOC_COPY_RANGE), into the slot the large
+# write file has left by then.
+COPY_PATH = '/churn/wcopy'
+
+# struct sfs_copy_range and SFS_IOC_COPY_RANGE in sfs.h.
+COPY_RANGE = struct.Struct('=1024sQQQ')
+IOC_COPY_RANGE = (3 << 30) | (COPY_RANGE.size << 16) | (ord('S') << 8) | 1
+
+# Driver switches always passed. The kernel page cache would otherwise serve
+# most repeated reads without ever reaching the driver.
+DEFAULT_DRIVER_ARGS = ['--no-kernel-cache']
+
+
+class BenchError(Exception):
+    pass
+
+
+def run_cmd(args):
+    proc = subprocess.run(args, stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE, universal_newlines=True)
+    if proc.returncode:
+        raise BenchError('Command returned non-zero value.\n' +
+                'Command: %s\nReturn code: %d\nstdout: %s\nstderr: %s' % \
+                (' '.join(args), proc.returncode, proc.stdout, proc.stderr))
+    return proc.stdout
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    samples = sorted(samples)
+    idx = min(len(samples) - 1, int(len(samples) * pct / 100.0))
+    return samples[idx]
+
+
+class Image:
+    """An SFS image laid out for the benchmarks, created with mkfs.sfs."""
+
+    def __init__(self, path, randomize, seed):
+        self.path = path
+        self.randomize = randomize
+        self.seed = seed
+
+
+    def spec(self, tmpdir):
+        big = os.path.join(tmpdir, 'big.data')
+        small = os.path.join(tmpdir, 'small.data')
+        with open(big, 'wb') as f:
+            f.write(os.urandom(BIG_SIZE))
+        with open(small, 'wb') as f:
+            f.write(bytes(SMALL_SIZE))
+
+        spec = []
+        path = ''
+        for depth in range(1, max(STAT_DEPTHS) + 1):
+            path += '/d%d' % depth
+            spec.append('%s/f' % path)
+
+        spec += ['/full/f%02d' % i for i in range(SUBDIR_ENTRIES)]
+        spec += ['/churn/', '/big:%s' % big, '/small:%s' % small]
+
+        # /d1, /full, /churn, /big and /small, plus padding up to a full root
+        used = 5
+        spec += ['/r%02d' % i for i in range(ROOTDIR_ENTRIES - used)]
+        return spec
+
+
+    def create(self):
+        args = [MKFS, '--quiet']
+        if self.randomize:
+            args += ['--randomize', '--seed', str(self.seed)]
+
+        tmpdir = tempfile.mkdtemp(prefix='sfs-bench-')
+        try:
+            run_cmd(args + [self.path] + self.spec(tmpdir))
+        finally:
+            shutil.rmtree(tmpdir)
+
+
+    def fsck(self):
+        run_cmd([FSCK, self.path])
+
+
+class Mount:
+    """Runs the driver in the foreground on an image, with statistics on."""
+
+    def __init__(self, image, mountpoint, driver, driver_args):
+        self.image = image
+        self.mountpoint = mountpoint
+        self.driver = driver
+        self.driver_args = driver_args
+        self.stats_path = image.path + '.stats'
+        self.proc = None
+        self.seq = 0
+
+
+    def __enter__(self):
+        os.makedirs(self.mountpoint, exist_ok=True)
+        self.proc = subprocess.Popen([self.driver, '-f'] + self.driver_args +
+                ['--stats=%s' % os.path.abspath(self.stats_path),
+                 '-i', self.image.path, self.mountpoint],
+                stdout=subprocess.DEVNULL)
+
+        deadline = time.monotonic() + TIMEOUT
+        while not os.path.ismount(self.mountpoint):
+            if self.proc.poll() is not None:
+                raise BenchError('Driver exited with %d before mounting'
+                        % self.proc.returncode)
+            if time.monotonic() > deadline:
+                raise BenchError('Timeout waiting for the driver to mount')
+            time.sleep(0.01)
+        return self
+
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        subprocess.run(['fusermount', '-u', self.mountpoint],
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            self.proc.wait(timeout=TIMEOUT)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+        for path in (self.stats_path, self.stats_path + '.tmp'):
+            if os.path.exists(path):
+                os.remove(path)
+
+
+    def path(self, path):
+        return os.path.join(self.mountpoint, path.lstrip('/'))
+
+
+    def stats(self):
+        """Ask the driver for a fresh dump of its counters and return it."""
+        self.proc.send_signal(signal.SIGUSR1)
+        deadline = time.monotonic() + TIMEOUT
+        while True:
+            try:
+                with open(self.stats_path) as f:
+                    st = json.load(f)
+                if st['seq'] > self.seq:
+                    self.seq = st['seq']
+                    return st
+            except (OSError, ValueError):
+                pass
+            if time.monotonic() > deadline:
+                raise BenchError('Timeout waiting for driver statistics')
+            time.sleep(0.001)
+
+
+class Phase:
+    """
+    One benchmark. run() calls op() once per operation and times it; each
+    call may return the number of operations it performed (default 1).
+    """
+
+    def __init__(self, name, op, iterations, setup=None, teardown=None):
+        self.name = name
+        self.op = op
+        self.iterations = iterations
+        self.setup = setup
+        self.teardown = teardown
+
+
+    def run(self, mnt):
+        ctx = self.setup(mnt) if self.setup else None
+        try:
+            samples = []
+            ops = 0
+            before = mnt.stats()
+            start = time.perf_counter()
+            for i in range(self.iterations):
+                t = time.perf_counter()
+                n = self.op(mnt, ctx, i) or 1
+                samples.append((time.perf_counter() - t) / n)
+                ops += n
+            elapsed = time.perf_counter() - start
+            after = mnt.stats()
+        finally:
+            if self.teardown:
+                self.teardown(mnt, ctx)
+
+        # The two stats requests themselves do no disk I/O.
+        delta = {k: after['disk'][k] - before['disk'][k]
+                 for k in after['disk']}
+        hits = after['cache']['hits'] - before['cache']['hits']
+        misses = after['cache']['misses'] - before['cache']['misses']
+        return {
+            'ops': ops,
+            'ops_per_sec': ops / elapsed if elapsed else 0.0,
+            'p50_us': percentile(samples, 50) * 1e6,
+            'p99_us': percentile(samples, 99) * 1e6,
+            'syscalls_per_op': delta['syscalls'] / ops,
+            'cache_hit_ratio': hits / (hits + misses) if hits + misses \
+                    else None,
+            'disk': delta,
+        }
+
+
+def stat_path(depth):
+    return ''.join('/d%d' % d for d in range(1, depth + 1)) + '/f'
+
+
+def op_stat(depth):
+    path = stat_path(depth)
+    def op(mnt, ctx, i):
+        os.stat(mnt.path(path))
+    return op
+
+
+def op_readdir(path):
+    def op(mnt, ctx, i):
+        os.listdir(mnt.path(path))
+    return op
+
+
+def open_ro(path):
+    def setup(mnt):
+        return {'fd': os.open(mnt.path(path), os.O_RDONLY)}
+    return setup
+
+
+def open_rw(path):
+    def setup(mnt):
+        return {'fd': os.open(mnt.path(path), os.O_RDWR)}
+    return setup
+
+
+def close_fd(mnt, ctx):
+    os.close(ctx['fd'])
+
+
+def op_seqread(mnt, ctx, i):
+    off = (i * READ_CHUNK) % BIG_SIZE
+    os.pread(ctx['fd'], READ_CHUNK, off)
+
+
+def op_randread(rng):
+    def op(mnt, ctx, i):
+        off = rng.randrange(BIG_SIZE // RANDREAD_SIZE) * RANDREAD_SIZE
+        os.pread(ctx['fd'], RANDREAD_SIZE, off)
+    return op
+
+
+def op_smallwrite(rng):
+    buf = bytes(SMALLWRITE_SIZE)
+    def op(mnt, ctx, i):
+        off = rng.randrange(SMALL_SIZE // SMALLWRITE_SIZE) * SMALLWRITE_SIZE
+        os.pwrite(ctx['fd'], buf, off)
+    return op
+
+
+def setup_largewrite(mnt):
+    fd = os.open(mnt.path(LARGEWRITE_PATH), os.O_RDWR | os.O_CREAT, 0o644)
+    return {'fd': fd, 'buf': bytes(LARGEWRITE_SIZE)}
+
+
+def op_largewrite(mnt, ctx, i):
+    off = (i * LARGEWRITE_SIZE) % LARGEWRITE_TOTAL
+    os.pwrite(ctx['fd'], ctx['buf'], off)
+
+
+def teardown_largewrite(mnt, ctx):
+    os.close(ctx['fd'])
+    os.unlink(mnt.path(LARGEWRITE_PATH))
+
+
+def setup_copy(mnt):
+    fd = os.open(mnt.path(COPY_PATH), os.O_WRONLY | os.O_CREAT, 0o644)
+    return {'fd': fd}
+
+
+def op_copy(mnt, ctx, i):
+    # Larger than fcntl.ioctl allows for an immutable argument.
+    arg = bytearray(COPY_RANGE.pack(b'/small', 0, 0, SMALL_SIZE))
+    fcntl.ioctl(ctx['fd'], IOC_COPY_RANGE, arg, True)
+    res = COPY_RANGE.unpack(arg)
+    if res[3] != SMALL_SIZE:
+        raise BenchError('Copied %d bytes instead of %d' % (res[3],
+                SMALL_SIZE))
+
+
+def teardown_copy(mnt, ctx):
+    os.close(ctx['fd'])
+    os.unlink(mnt.path(COPY_PATH))
+
+
+def op_churn(mnt, ctx, i):
+    # A create and an unlink: two operations.
+    path = mnt.path('/churn/c%d' % (i % (SUBDIR_ENTRIES - 1)))
+    os.close(os.open(path, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o644))
+    os.unlink(path)
+    return 2
+
+
+def phases(iterations, seed):
+    rng = random.Random(seed)
+    ret = [Phase('stat_depth%d' % d, op_stat(d), iterations)
+           for d in STAT_DEPTHS]
+    ret += [
+        Phase('readdir_root', op_readdir('/'), iterations),
+        Phase('readdir_subdir', op_readdir('/full'), iterations),
+        Phase('read_seq', op_seqread, iterations, open_ro('/big'), close_fd),
+        Phase('read_random', op_randread(rng), iterations, open_ro('/big'),
+            close_fd),
+        Phase('churn_create_unlink', op_churn, iterations),
+        Phase('write_small', op_smallwrite(rng), iterations, open_rw('/small'),
+            close_fd),
+        Phase('write_large', op_largewrite, max(1, iterations // 16),
+            setup_largewrite, teardown_largewrite),
+        Phase('copy_large', op_copy, max(1, iterations // 16), setup_copy,
+            teardown_copy),
+    ]
+    return ret
+
+
+def run_layout(layout, args, workdir):
+    image = Image(os.path.join(workdir, '%s.img' % layout),
+            layout == 'random', args.seed)
+    image.create()
+
+    results = {}
+    mountpoint = os.path.join(workdir, 'mnt')
+    with Mount(image, mountpoint, args.driver,
+            DEFAULT_DRIVER_ARGS + args.driver_args) as mnt:
+        for phase in phases(args.iterations, args.seed):
+            if args.only and phase.name not in args.only:
+                continue
+            results[phase.name] = phase.run(mnt)
+
+    image.fsck()
+    return results
+
+
+def print_results(layout, results, outfile):
+    outfile.write('\n%s layout\n' % layout)
+    outfile.write('%-22s %9s %12s %10s %10s %12s %10s\n' % ('phase', 'ops',
+        'ops/s', 'p50 (us)', 'p99 (us)', 'syscalls/op', 'cache hit'))
+    for name, r in results.items():
+        ratio = r['cache_hit_ratio']
+        outfile.write('%-22s %9d %12.0f %10.1f %10.1f %12.2f %10s\n' % (name,
+            r['ops'], r['ops_per_sec'], r['p50_us'], r['p99_us'],
+            r['syscalls_per_op'],
+            '-' if ratio is None else '%.1f%%' % (ratio * 100)))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run microbenchmarks against the SFS driver. Each layout '
+                    'gets a fresh image from mkfs.sfs, which is mounted and '
+                    'checked with fsck.sfs afterwards. Syscalls per op count '
+                    'the system calls the driver made on the image file.'
+    )
+    parser.add_argument(
+        '-l',
+        '--layout',
+        choices=('random', 'contiguous', 'both'),
+        default='both',
+        help='image layout: randomized (mkfs.sfs -r) or contiguous '
+             '(default: both)',
+    )
+    parser.add_argument(
+        '-n',
+        '--iterations',
+        type=int,
+        default=1000,
+        help='operations per phase (default: 1000)',
+    )
+    parser.add_argument(
+        '-s',
+        '--seed',
+        type=int,
+        default=1,
+        help='seed for the image layout and random offsets (default: 1)',
+    )
+    parser.add_argument(
+        '--driver',
+        default=FUSE_BIN,
+        help='driver binary (default: %s)' % FUSE_BIN,
+    )
+    parser.add_argument(
+        '-a',
+        '--driver-arg',
+        dest='driver_args',
+        action='append',
+        default=[],
+        help='extra argument for the driver, e.g. -a=--cache=64 '
+             '(may be repeated)',
+    )
+    parser.add_argument(
+        '-j',
+        '--json',
+        type=argparse.FileType('w'),
+        help='also write the results as JSON to this file',
+    )
+    parser.add_argument(
+        nargs='*',
+        dest='only',
+        help='which phases to run (default: all)',
+    )
+    args = parser.parse_args()
+
+    layouts = ['random', 'contiguous'] if args.layout == 'both' \
+            else [args.layout]
+
+    workdir = tempfile.mkdtemp(prefix='sfs-bench-')
+    results = {}
+    try:
+        for layout in layouts:
+            results[layout] = run_layout(layout, args, workdir)
+            print_results(layout, results[layout], sys.stdout)
+    except BenchError as e:
+        sys.stderr.write('%s\n' % e)
+        return 1
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.json:
+        json.dump({'seed': args.seed, 'iterations': args.iterations,
+                   'driver_args': DEFAULT_DRIVER_ARGS + args.driver_args,
+                   'results': results}, args.json, indent=2)
+        args.json.write('\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
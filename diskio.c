@@ -4,6 +4,15 @@
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/io_uring.h>
 
 #include "diskio.h"
 #include "sfs.h"
@@ -13,6 +22,237 @@ const size_t disk_size = SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
 
 static int img_fd = -1;
 
+/* Backend used by disk_read/disk_write. */
+enum disk_backend {
+    DISK_PREAD,
+    DISK_MMAP,
+};
+
+static enum disk_backend backend = DISK_PREAD;
+
+/* The mapped image and its size, for the mmap backend. */
+static char *img_map;
+static size_t img_map_size;
+
+/*
+ * Per-thread statistics (see diskio.h). Each area is preceded by a header
+ * linking it into its set; `used` is cleared when the owning thread exits, by
+ * the destructor of the set's thread-specific key, which is created on first
+ * use. Areas are never freed.
+ */
+struct stats_area {
+    struct stats_area *next;
+    struct stats_set *set;
+    int used;
+    unsigned long counters[];
+};
+
+struct stats_set {
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    int ready;
+    struct stats_area *areas;
+};
+
+
+struct stats_set *stats_set_new(size_t size)
+{
+    struct stats_set *set = calloc(1, sizeof(struct stats_set));
+
+    if (set) {
+        set->size = size;
+        pthread_mutex_init(&set->lock, NULL);
+    }
+    return set;
+}
+
+
+static void stats_release(void *arg)
+{
+    struct stats_area *a = arg;
+
+    pthread_mutex_lock(&a->set->lock);
+    a->used = 0;
+    pthread_mutex_unlock(&a->set->lock);
+}
+
+
+void *stats_local(struct stats_set *set)
+{
+    struct stats_area *a;
+
+    if (__atomic_load_n(&set->ready, __ATOMIC_ACQUIRE)
+            && (a = pthread_getspecific(set->key))) {
+        return a->counters;
+    }
+
+    pthread_mutex_lock(&set->lock);
+
+    if (!set->ready) {
+        if (pthread_key_create(&set->key, stats_release) != 0) {
+            pthread_mutex_unlock(&set->lock);
+            return NULL;
+        }
+        __atomic_store_n(&set->ready, 1, __ATOMIC_RELEASE);
+    }
+
+    for (a = set->areas; a && a->used; a = a->next)
+        ;
+    if (!a && (a = calloc(1, sizeof(struct stats_area) + set->size))) {
+        a->set = set;
+        a->next = set->areas;
+        set->areas = a;
+    }
+    if (a) {
+        a->used = 1;
+        pthread_setspecific(set->key, a);
+    }
+
+    pthread_mutex_unlock(&set->lock);
+
+    return a ? a->counters : NULL;
+}
+
+
+void stats_sum(struct stats_set *set, void *sum)
+{
+    unsigned long *dst = sum;
+    size_t n = set->size / sizeof(unsigned long);
+
+    memset(sum, 0, set->size);
+
+    pthread_mutex_lock(&set->lock);
+    for (struct stats_area *a = set->areas; a; a = a->next) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] += __atomic_load_n(&a->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+
+void stats_each(struct stats_set *set, void (*fn)(void *area, void *arg),
+                void *arg)
+{
+    pthread_mutex_lock(&set->lock);
+    for (struct stats_area *a = set->areas; a; a = a->next) {
+        fn(a->counters, arg);
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+
+void op_stats_begin(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+
+unsigned long op_stats_end(struct op_stats *st, const struct timespec *start,
+                           size_t bytes, int error)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    unsigned long ns = (now.tv_sec - start->tv_sec) * 1000000000UL
+                       + now.tv_nsec - start->tv_nsec;
+    unsigned bucket = ns ? 64 - __builtin_clzl(ns) : 0;
+
+    if (bucket >= OP_STATS_BUCKETS) {
+        bucket = OP_STATS_BUCKETS - 1;
+    }
+
+    STATS_ADD(st->calls, 1);
+    STATS_ADD(st->errors, error != 0);
+    STATS_ADD(st->bytes, bytes);
+    STATS_ADD(st->ns, ns);
+    STATS_ADD(st->hist[bucket], 1);
+    return ns;
+}
+
+
+unsigned long op_stats_percentile(const struct op_stats *st, unsigned pct)
+{
+    unsigned long want = (st->calls * pct + 99) / 100;
+    unsigned long seen = 0;
+
+    for (unsigned i = 0; i < OP_STATS_BUCKETS; i++) {
+        seen += st->hist[i];
+        if (seen >= want && seen) {
+            return 1UL << i;
+        }
+    }
+    return 0;
+}
+
+
+/* I/O counters (see disk_get_stats). */
+static struct stats_set disk_stats_set = {
+    sizeof(struct disk_stats), PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL
+};
+
+#define STAT_ADD(field, n) \
+    do { \
+        struct disk_stats *st_ = stats_local(&disk_stats_set); \
+        if (st_) { \
+            STATS_ADD(st_->field, (n)); \
+        } \
+    } while (0)
+
+
+/* Count a disk_* call of kind `op`, which started at `start`. */
+static void disk_op_end(enum disk_op op, const struct timespec *start,
+                        size_t bytes)
+{
+    struct disk_stats *st = stats_local(&disk_stats_set);
+
+    if (st) {
+        op_stats_end(&st->ops[op], start, bytes, 0);
+    }
+}
+
+
+int disk_set_backend(const char *name)
+{
+    if (strcmp(name, "pread") == 0) {
+        backend = DISK_PREAD;
+    } else if (strcmp(name, "mmap") == 0) {
+        backend = DISK_MMAP;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+static void disk_map_image(void)
+{
+    struct stat st;
+
+    if (fstat(img_fd, &st) == -1) {
+        perror("Could not stat disk image");
+        exit(1);
+    }
+
+    /* mkfs leaves out unused data blocks, so grow the image to its full size
+     * first: writes to a mapping cannot extend the file. */
+    if ((size_t)st.st_size < disk_size && ftruncate(img_fd, disk_size) == -1) {
+        perror("Could not extend disk image");
+        exit(1);
+    }
+
+    img_map_size = (size_t)st.st_size < disk_size ? disk_size
+                                                  : (size_t)st.st_size;
+    img_map = mmap(NULL, img_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   img_fd, 0);
+    if (img_map == MAP_FAILED) {
+        perror("Could not map disk image");
+        exit(1);
+    }
+}
+
 
 void disk_open_image(const char *filename)
 {
@@ -27,40 +267,101 @@ void disk_open_image(const char *filename)
         exit(1);
     }
 
+    if (backend == DISK_MMAP) {
+        disk_map_image();
+    }
+
     disk_verify_magic();
 }
 
 
-void disk_read(void *buf, size_t size, off_t offset)
+static void flusher_join(void);
+
+
+void disk_close_image(void)
+{
+    if (img_fd == -1) {
+        return;
+    }
+
+    flusher_join();
+    disk_sync(1);
+
+    if (img_map) {
+        munmap(img_map, img_map_size);
+        img_map = NULL;
+    }
+
+    close(img_fd);
+    img_fd = -1;
+}
+
+
+static void raw_read(void *buf, size_t size, off_t offset)
 {
     ssize_t ret;
 
+    if (backend == DISK_MMAP) {
+        assert(offset >= 0);
+        if ((size_t)offset > img_map_size || size > img_map_size - offset) {
+            fprintf(stderr, "Could not read %zu bytes from disk at offset "
+                    "%#lx, beyond end of image\n", size, offset);
+            exit(1);
+        }
+        memcpy(buf, img_map + offset, size);
+        return;
+    }
+
     ret = pread(img_fd, buf, size, offset);
+    STAT_ADD(syscalls, 1);
     if (ret == -1) {
         perror("Error reading from disk");
         exit(1);
     }
 
     if ((size_t)ret != size) {
-        fprintf(stderr, "Could not read %zu bytes from disk, only got %zd\n",
-                size, ret);
+        /* mkfs leaves out trailing data blocks that were never written, so
+         * within the image's full size a short read just means zeroes. */
+        if ((size_t)offset + size > disk_size) {
+            fprintf(stderr, "Could not read %zu bytes from disk, only got "
+                    "%zd\n", size, ret);
+            exit(1);
+        }
+        memset((char *)buf + ret, 0, size - ret);
+    }
+}
+
+
+/* Stop on a write that does not lie entirely within the image. */
+static void check_write_range(size_t size, off_t offset)
+{
+    if (offset < 0 || (size_t)offset > disk_size
+            || size > disk_size - offset) {
+        fprintf(stderr, "Error: write to disk outside of range of addressable "
+                "blocks: offset=%#lx size=%zu\n", offset, size);
         exit(1);
     }
 }
 
 
-void disk_write(const void *buf, size_t size, off_t offset)
+static void raw_write(const void *buf, size_t size, off_t offset)
 {
     ssize_t ret;
 
-    assert(offset >= 0);
-    if ((size_t)offset >= disk_size) {
-        fprintf(stderr, "Error: write to disk outside of range of addressable "
-                "blocks: offset=%#lx size=%zu\n", offset, size);
-        assert((size_t)offset < disk_size);
+    check_write_range(size, offset);
+
+    if (backend == DISK_MMAP) {
+        if ((size_t)offset > img_map_size || size > img_map_size - offset) {
+            fprintf(stderr, "Could not write %zu bytes to disk at offset "
+                    "%#lx, beyond end of image\n", size, offset);
+            exit(1);
+        }
+        memcpy(img_map + offset, buf, size);
+        return;
     }
 
     ret = pwrite(img_fd, buf, size, offset);
+    STAT_ADD(syscalls, 1);
     if (ret == -1) {
         perror("Error writing to disk");
         exit(1);
@@ -73,6 +374,1241 @@ void disk_write(const void *buf, size_t size, off_t offset)
     }
 }
 
+/*
+ * Batched I/O. Each thread that submits a batch gets its own io_uring
+ * instance (set up on first use and torn down when the thread exits), so
+ * batches from different FUSE threads never contend. The rings are driven with
+ * the raw syscalls, to avoid depending on liburing. If io_uring cannot be set
+ * up (old kernel, seccomp, ...) batches fall back to preadv/pwritev.
+ */
+#define URING_ENTRIES   64u
+#define BATCH_IOV_MAX   256u
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/* Set once io_uring_setup fails, after which no thread tries again. */
+static int uring_unavailable;
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+
+static void uring_destroy(void *arg)
+{
+    struct uring *ring = arg;
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+
+static void uring_key_init(void)
+{
+    pthread_key_create(&uring_key, uring_destroy);
+}
+
+
+static struct uring *uring_setup(void)
+{
+    struct io_uring_params p;
+    struct uring *ring = calloc(1, sizeof(struct uring));
+
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes
+                         + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return ring;
+}
+
+
+/* This thread's ring, or NULL if io_uring is not available. */
+static struct uring *uring_get(void)
+{
+    if (__atomic_load_n(&uring_unavailable, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    pthread_once(&uring_key_once, uring_key_init);
+
+    struct uring *ring = pthread_getspecific(uring_key);
+    if (!ring) {
+        ring = uring_setup();
+        if (!ring) {
+            __atomic_store_n(&uring_unavailable, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        pthread_setspecific(uring_key, ring);
+    }
+    return ring;
+}
+
+
+/* Synchronously finish (the remainder of) a request that came back short. */
+static void disk_req_finish(const struct disk_req *req, size_t done)
+{
+    if (req->write) {
+        raw_write((const char *)req->buf + done, req->size - done,
+                  req->offset + done);
+    } else {
+        raw_read((char *)req->buf + done, req->size - done,
+                 req->offset + done);
+    }
+}
+
+
+static void vector_batch(struct disk_req *reqs, unsigned n);
+
+
+/* Submit up to URING_ENTRIES requests and wait for all of them. If the kernel
+ * only accepts some, the rest are taken back and done with vector_batch once
+ * the accepted ones completed. Returns -1 if the ring turned out to be
+ * unusable, in which case nothing was submitted. */
+static int uring_batch(struct uring *ring, struct disk_req *reqs, unsigned n)
+{
+    struct iovec iov[URING_ENTRIES];
+    unsigned tail = *ring->sq_tail;
+
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+        iov[i].iov_base = reqs[i].buf;
+        iov[i].iov_len = reqs[i].size;
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = img_fd;
+        sqe->off = reqs[i].offset;
+        sqe->addr = (uintptr_t)&iov[i];
+        sqe->len = 1;
+        sqe->user_data = i;
+
+        ring->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, n, n,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        STAT_ADD(syscalls, 1);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        /* Nothing was consumed; take the submissions back. */
+        __atomic_store_n(ring->sq_tail, tail - n, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    /* The kernel consumes entries in order, so what it left are the last. */
+    unsigned submitted = ret;
+    if (submitted < n) {
+        __atomic_store_n(ring->sq_tail, tail - (n - submitted),
+                         __ATOMIC_RELEASE);
+    }
+
+    unsigned reaped = 0;
+    while (reaped < submitted) {
+        unsigned head = *ring->cq_head;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            do {
+                ret = syscall(__NR_io_uring_enter, ring->fd, 0,
+                              submitted - reaped,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+                STAT_ADD(syscalls, 1);
+            } while (ret == -1 && errno == EINTR);
+
+            if (ret == -1) {
+                perror("Error waiting for disk I/O");
+                exit(1);
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct disk_req *req = &reqs[cqe->user_data];
+
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror(req->write ? "Error writing to disk" : "Error reading from disk");
+            exit(1);
+        }
+        if ((size_t)cqe->res != req->size) {
+            disk_req_finish(req, cqe->res);
+        }
+
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        reaped++;
+    }
+
+    if (submitted < n) {
+        vector_batch(reqs + submitted, n - submitted);
+    }
+    return 0;
+}
+
+
+static int disk_req_cmp(const void *a, const void *b)
+{
+    const struct disk_req *ra = a, *rb = b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+
+/* Fallback: one preadv/pwritev per run of adjacent requests. Sorts `reqs`. */
+static void vector_batch(struct disk_req *reqs, unsigned n)
+{
+    struct iovec iov[BATCH_IOV_MAX];
+
+    qsort(reqs, n, sizeof(struct disk_req), disk_req_cmp);
+
+    for (unsigned i = 0; i < n; ) {
+        unsigned cnt = 0;
+        size_t total = 0;
+
+        while (i + cnt < n && cnt < BATCH_IOV_MAX
+                && reqs[i + cnt].write == reqs[i].write
+                && reqs[i + cnt].offset == reqs[i].offset + (off_t)total) {
+            iov[cnt].iov_base = reqs[i + cnt].buf;
+            iov[cnt].iov_len = reqs[i + cnt].size;
+            total += reqs[i + cnt].size;
+            cnt++;
+        }
+
+        ssize_t ret = reqs[i].write
+                      ? pwritev(img_fd, iov, cnt, reqs[i].offset)
+                      : preadv(img_fd, iov, cnt, reqs[i].offset);
+        STAT_ADD(syscalls, 1);
+        if (ret == -1) {
+            perror(reqs[i].write ? "Error writing to disk" : "Error reading from disk");
+            exit(1);
+        }
+
+        /* Finish whatever came back short. */
+        size_t done = ret;
+        for (unsigned j = i; j < i + cnt; j++) {
+            if (done < reqs[j].size) {
+                disk_req_finish(&reqs[j], done);
+            }
+            done = done > reqs[j].size ? done - reqs[j].size : 0;
+        }
+
+        i += cnt;
+    }
+}
+
+
+/* Perform a batch directly on the image, bypassing the cache. */
+static void raw_batch(struct disk_req *reqs, unsigned n)
+{
+    if (backend == DISK_MMAP || n == 1) {
+        for (unsigned i = 0; i < n; i++) {
+            disk_req_finish(&reqs[i], 0);
+        }
+        return;
+    }
+
+    struct uring *ring = uring_get();
+
+    for (unsigned i = 0; i < n; i += URING_ENTRIES) {
+        unsigned cnt = n - i < URING_ENTRIES ? n - i : URING_ENTRIES;
+
+        if (!ring || uring_batch(ring, reqs + i, cnt) != 0) {
+            ring = NULL;
+            vector_batch(reqs + i, cnt);
+        }
+    }
+}
+
+
+/*
+ * Buffer cache. The image is divided into cache blocks of SFS_BLOCK_SIZE bytes
+ * aligned to the root directory, so every directory, block table and data
+ * block maps onto whole cache blocks (only the magic in front is not cached).
+ * A fixed pool of buffers, allocated once by disk_cache_init, is indexed by a
+ * hash on the block number and recycled with the CLOCK algorithm. All of
+ * disk_read, disk_write and disk_batch go through it.
+ *
+ * By default writes are write-through: cached copies are updated and the data
+ * is always written to the image as well. In write-back mode, writes only
+ * update the cache and mark the buffer dirty, after reading in the rest of
+ * blocks they only partly cover (see cache_wb_get); see cache_writeback for
+ * how dirty buffers reach the image. Read misses are read straight into the
+ * caller's buffer, one request per run of missing blocks, and blocks that were
+ * read whole are then copied into the cache.
+ *
+ * cache_lock protects the pool but is never held during I/O. A buffer that is
+ * being filled by a read is marked BUSY until the read completes. Writes to a
+ * block whose buffer is BUSY mark it STALE, so the older data is dropped
+ * instead of being cached. Writes to uncached blocks insert a BUSY placeholder
+ * for the same reason, or, if no buffer is free, bump cache_write_gen, which
+ * makes every read in flight drop what it loaded. Buffers with I/O in flight
+ * are pinned and are never evicted. Concurrent writes to the same bytes must
+ * be ordered by the caller, as without a cache.
+ */
+#define CACHE_BASE      SFS_ROOTDIR_OFF
+#define CACHE_PENDING   1024u
+#define CACHE_RAW_MAX   256u
+
+#define CBUF_HASHED     (1u << 0)   /* In the hash table */
+#define CBUF_VALID      (1u << 1)   /* Holds the block's current data */
+#define CBUF_BUSY       (1u << 2)   /* Being loaded, or placeholder of a write */
+#define CBUF_STALE      (1u << 3)   /* Written to while BUSY: drop when done */
+#define CBUF_REF        (1u << 4)   /* Used since the clock hand last passed */
+#define CBUF_DIRTY      (1u << 5)   /* Newer than the image (write-back) */
+#define CBUF_DIRENT     (1u << 6)   /* Dirty with directory entries */
+
+struct cbuf {
+    size_t blkno;
+    unsigned flags;
+    unsigned pins;
+    struct cbuf *hnext;
+};
+
+static struct cbuf *cache_bufs;
+static char *cache_data;
+static struct cbuf **cache_hash;
+static unsigned cache_nbufs;
+static unsigned cache_hand;
+static unsigned long cache_write_gen;
+static int cache_wb;
+static unsigned cache_ndirty;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void disk_cache_init(size_t size, int writeback)
+{
+    cache_nbufs = size / SFS_BLOCK_SIZE;
+    if (cache_nbufs == 0) {
+        return;
+    }
+    cache_wb = writeback;
+
+    cache_bufs = calloc(cache_nbufs, sizeof(struct cbuf));
+    cache_hash = calloc(cache_nbufs, sizeof(struct cbuf *));
+    cache_data = malloc((size_t)cache_nbufs * SFS_BLOCK_SIZE);
+    if (!cache_bufs || !cache_hash || !cache_data) {
+        fprintf(stderr, "Could not allocate a %zu byte buffer cache\n", size);
+        exit(1);
+    }
+}
+
+
+static char *cbuf_data(const struct cbuf *c)
+{
+    return cache_data + (size_t)(c - cache_bufs) * SFS_BLOCK_SIZE;
+}
+
+
+static struct cbuf **cache_slot(size_t blkno)
+{
+    struct cbuf **cp = &cache_hash[blkno % cache_nbufs];
+
+    while (*cp && (*cp)->blkno != blkno) {
+        cp = &(*cp)->hnext;
+    }
+    return cp;
+}
+
+
+static void cache_drop(struct cbuf *c)
+{
+    if (c->flags & CBUF_HASHED) {
+        *cache_slot(c->blkno) = c->hnext;
+    }
+    c->flags = 0;
+}
+
+
+/* Take a buffer for `blkno`, which must not be cached, evicting the first
+ * unreferenced buffer the clock hand finds. Returns NULL if every buffer is in
+ * use. */
+static struct cbuf *cache_alloc(size_t blkno)
+{
+    for (unsigned scanned = 0; scanned < 2 * cache_nbufs; scanned++) {
+        struct cbuf *c = &cache_bufs[cache_hand];
+
+        cache_hand = (cache_hand + 1) % cache_nbufs;
+
+        if (c->pins || (c->flags & (CBUF_BUSY | CBUF_DIRTY))) {
+            continue;
+        }
+        if (c->flags & CBUF_REF) {
+            c->flags &= ~CBUF_REF;
+            continue;
+        }
+
+        cache_drop(c);
+
+        struct cbuf **cp = &cache_hash[blkno % cache_nbufs];
+        c->blkno = blkno;
+        c->flags = CBUF_HASHED;
+        c->hnext = *cp;
+        *cp = c;
+        return c;
+    }
+    return NULL;
+}
+
+
+/*
+ * A batch as it is pushed through the cache: the requests that still have to
+ * go to the image, and the buffers to finish once they are done. `src` is the
+ * caller's copy of a block that was read whole into its buffer, to be copied
+ * into the cache (NULL for writes).
+ */
+struct cache_batch {
+    struct disk_req raw[CACHE_RAW_MAX];
+    unsigned nraw;
+    struct {
+        struct cbuf *c;
+        const char *src;
+    } pend[CACHE_PENDING];
+    unsigned npend;
+    unsigned long gen;
+    int dirent;
+};
+
+
+/* Perform the collected I/O and finish the pending buffers. Called and returns
+ * with cache_lock held. */
+static void cache_flush(struct cache_batch *b)
+{
+    pthread_mutex_unlock(&cache_lock);
+    raw_batch(b->raw, b->nraw);
+    pthread_mutex_lock(&cache_lock);
+
+    for (unsigned i = 0; i < b->npend; i++) {
+        struct cbuf *c = b->pend[i].c;
+
+        c->pins--;
+        if (!(c->flags & CBUF_BUSY)) {
+            continue;
+        }
+
+        if (b->pend[i].src && !(c->flags & CBUF_STALE)
+                && b->gen == cache_write_gen) {
+            memcpy(cbuf_data(c), b->pend[i].src, SFS_BLOCK_SIZE);
+            c->flags = CBUF_HASHED | CBUF_VALID | CBUF_REF;
+        } else {
+            cache_drop(c);
+        }
+    }
+
+    b->nraw = 0;
+    b->npend = 0;
+    b->gen = cache_write_gen;
+}
+
+
+static void cache_pend(struct cache_batch *b, struct cbuf *c, const char *src)
+{
+    c->pins++;
+    b->pend[b->npend].c = c;
+    b->pend[b->npend].src = src;
+    b->npend++;
+}
+
+
+static void cache_raw(struct cache_batch *b, char *buf, size_t size,
+                      off_t offset, int write)
+{
+    if (size == 0) {
+        return;
+    }
+    b->raw[b->nraw].buf = buf;
+    b->raw[b->nraw].size = size;
+    b->raw[b->nraw].offset = offset;
+    b->raw[b->nraw].write = write;
+    b->nraw++;
+}
+
+
+static void flusher_start(void);
+static void cache_writeback(void);
+
+
+/*
+ * In write-back mode, get the buffer of block `blk` ready for a write to be
+ * absorbed into it, so that the write is ordered with the others by
+ * cache_writeback rather than going straight to the image: wait for any read
+ * of the block in flight to finish, read the block in first unless the write
+ * covers it `whole`, and write back dirty buffers if there is no free one.
+ * Returns NULL if no buffer could be had after all. Called and returns with
+ * cache_lock held, but drops it in between.
+ */
+static struct cbuf *cache_wb_get(struct cache_batch *b, size_t blk, int whole)
+{
+    int wroteBack = 0;
+
+    for (;;) {
+        struct cbuf *c = *cache_slot(blk);
+
+        if (c && !(c->flags & CBUF_BUSY)) {
+            return c;
+        }
+
+        /* The buffer may be BUSY with a read of our own batch. */
+        if (b->nraw || b->npend) {
+            cache_flush(b);
+            continue;
+        }
+
+        if (c) {
+            pthread_mutex_unlock(&cache_lock);
+            sched_yield();
+            pthread_mutex_lock(&cache_lock);
+            continue;
+        }
+
+        if (!(c = cache_alloc(blk))) {
+            if (wroteBack) {
+                return NULL;
+            }
+            pthread_mutex_unlock(&cache_lock);
+            cache_writeback();
+            pthread_mutex_lock(&cache_lock);
+            wroteBack = 1;
+            continue;
+        }
+
+        if (whole) {
+            c->flags |= CBUF_VALID;
+            return c;
+        }
+
+        struct disk_req req = { cbuf_data(c), SFS_BLOCK_SIZE,
+                                CACHE_BASE + (off_t)blk * SFS_BLOCK_SIZE, 0 };
+        unsigned long gen = cache_write_gen;
+
+        c->flags |= CBUF_BUSY;
+        c->pins++;
+        pthread_mutex_unlock(&cache_lock);
+        raw_batch(&req, 1);
+        pthread_mutex_lock(&cache_lock);
+        c->pins--;
+
+        if ((c->flags & CBUF_STALE) || gen != cache_write_gen) {
+            cache_drop(c);
+            continue;
+        }
+        c->flags = CBUF_HASHED | CBUF_VALID | CBUF_REF;
+        return c;
+    }
+}
+
+
+/*
+ * Serve the part [`from`, `from` + `len`) of block `blk` of a request entirely
+ * from the cache, if possible: reads of valid buffers, and in write-back mode
+ * writes to valid buffers or of whole blocks, which leave the buffer dirty.
+ * `c` is the block's buffer, if any. Returns 1 if nothing is left to do.
+ */
+static int cache_absorb(struct cache_batch *b, const struct disk_req *req,
+                        struct cbuf *c, size_t blk, char *p, size_t from,
+                        size_t len)
+{
+    if (!req->write) {
+        if (!c || !(c->flags & CBUF_VALID)) {
+            return 0;
+        }
+        memcpy(p, cbuf_data(c) + from, len);
+        c->flags |= CBUF_REF;
+        return 1;
+    }
+
+    if (!cache_wb || (c && (c->flags & CBUF_BUSY))) {
+        return 0;
+    }
+    if (!c) {
+        if (len != SFS_BLOCK_SIZE || !(c = cache_alloc(blk))) {
+            return 0;
+        }
+        c->flags |= CBUF_VALID;
+    }
+
+    memcpy(cbuf_data(c) + from, p, len);
+
+    if (!(c->flags & CBUF_DIRTY)) {
+        cache_ndirty++;
+        flusher_start();
+    }
+    c->flags |= CBUF_DIRTY | CBUF_REF;
+    if (b->dirent) {
+        c->flags |= CBUF_DIRENT;
+    }
+    return 1;
+}
+
+
+/*
+ * Push one request through the cache. Every block it covers is served from or
+ * copied into the cache where possible; the remaining runs of consecutive
+ * blocks (misses for reads, everything for writes) are added to `b` as raw
+ * requests, which are performed whenever `b` fills up.
+ */
+static void cache_req(struct cache_batch *b, const struct disk_req *req)
+{
+    char *buf = req->buf;
+    off_t end = req->offset + req->size;
+    size_t first = (req->offset - CACHE_BASE) / SFS_BLOCK_SIZE;
+    size_t last = (end - 1 - CACHE_BASE) / SFS_BLOCK_SIZE;
+    off_t runStart = -1;
+
+    for (size_t blk = first; blk <= last; blk++) {
+        off_t blkOff = CACHE_BASE + (off_t)blk * SFS_BLOCK_SIZE;
+        off_t from = blkOff > req->offset ? blkOff : req->offset;
+        off_t to = blkOff + SFS_BLOCK_SIZE < end ? blkOff + SFS_BLOCK_SIZE
+                                                 : end;
+        char *p = buf + (from - req->offset);
+        int whole = to - from == SFS_BLOCK_SIZE;
+
+        if (b->npend == CACHE_PENDING || b->nraw == CACHE_RAW_MAX) {
+            if (runStart >= 0) {
+                cache_raw(b, buf + (runStart - req->offset), from - runStart,
+                          runStart, req->write);
+                runStart = -1;
+            }
+            cache_flush(b);
+        }
+
+        struct cbuf *c = *cache_slot(blk);
+
+        if (req->write && cache_wb && (!c || (c->flags & CBUF_BUSY))) {
+            if (runStart >= 0) {
+                cache_raw(b, buf + (runStart - req->offset), from - runStart,
+                          runStart, req->write);
+                runStart = -1;
+            }
+            c = cache_wb_get(b, blk, whole);
+        }
+
+        if (cache_absorb(b, req, c, blk, p, from - blkOff, to - from)) {
+            if (!req->write) {
+                STAT_ADD(cache_hits, 1);
+            }
+            if (runStart >= 0) {
+                cache_raw(b, buf + (runStart - req->offset), from - runStart,
+                          runStart, req->write);
+                runStart = -1;
+            }
+            continue;
+        }
+
+        if (runStart < 0) {
+            runStart = from;
+        }
+
+        if (!req->write) {
+            STAT_ADD(cache_misses, 1);
+            if (!c && whole && (c = cache_alloc(blk))) {
+                c->flags |= CBUF_BUSY;
+                cache_pend(b, c, p);
+            }
+        } else if (c && (c->flags & CBUF_BUSY)) {
+            c->flags |= CBUF_STALE;
+        } else if (c) {
+            memcpy(cbuf_data(c) + (from - blkOff), p, to - from);
+            c->flags |= CBUF_REF;
+            cache_pend(b, c, NULL);
+        } else if ((c = cache_alloc(blk))) {
+            if (whole) {
+                memcpy(cbuf_data(c), p, SFS_BLOCK_SIZE);
+                c->flags |= CBUF_VALID | CBUF_REF;
+            } else {
+                c->flags |= CBUF_BUSY;
+            }
+            cache_pend(b, c, NULL);
+        } else {
+            cache_write_gen++;
+        }
+    }
+
+    if (runStart >= 0) {
+        cache_raw(b, buf + (runStart - req->offset), end - runStart,
+                  runStart, req->write);
+    }
+}
+
+
+/*
+ * Write-back. Dirty buffers are written to the image by cache_writeback, which
+ * runs on disk_sync (fsync, and flush when a file is closed), on unmount, every
+ * FLUSH_INTERVAL seconds from a background thread, and whenever more than half
+ * of the cache is dirty.
+ *
+ * A writeback goes in three passes: data blocks, then the block table, then
+ * directory entries (the root directory, and blocks written with
+ * disk_write_dirent). Interrupting it between passes therefore never leaves a
+ * directory entry or chain link pointing at data that is not there yet. Each
+ * pass is sorted by offset, and runs of adjacent blocks go out as one large
+ * vectored write.
+ *
+ * That order is right for blocks being allocated, but freeing needs the
+ * opposite: the entry that stops referring to the blocks must reach the image
+ * before they are marked free, and before they are reused. The caller orders
+ * those writes with disk_barrier, which writes back everything dirty at that
+ * point.
+ *
+ * The dirty buffers are copied while cache_lock is held, so a writeback writes
+ * the state of the cache at one instant, and writes in the meantime simply
+ * make the buffers dirty again. They stay pinned until they are written, so
+ * they are not evicted and read back from the image before their data is
+ * there. flush_lock serializes writebacks.
+ */
+#define FLUSH_INTERVAL  5
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running, flusher_stop;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* Writeback pass (0: data, 1: block table, 2: directory entries) of a dirty
+ * buffer. */
+static int cbuf_pass(const struct cbuf *c)
+{
+    off_t offset = CACHE_BASE + (off_t)c->blkno * SFS_BLOCK_SIZE;
+
+    if ((c->flags & CBUF_DIRENT) || offset < (off_t)SFS_BLOCKTBL_OFF) {
+        return 2;
+    }
+    return offset < (off_t)SFS_DATA_OFF;
+}
+
+
+static void cache_writeback(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&cache_lock);
+
+    unsigned n = cache_ndirty;
+    struct cbuf **dirty = n ? malloc(n * sizeof(struct cbuf *)) : NULL;
+    struct disk_req *reqs = n ? malloc(n * sizeof(struct disk_req)) : NULL;
+    unsigned char *pass = n ? malloc(n) : NULL;
+    char *copy = n ? malloc((size_t)n * SFS_BLOCK_SIZE) : NULL;
+
+    if (!dirty || !reqs || !pass || !copy) {
+        pthread_mutex_unlock(&cache_lock);
+        pthread_mutex_unlock(&flush_lock);
+        free(dirty);
+        free(reqs);
+        free(pass);
+        free(copy);
+        return;
+    }
+
+    n = 0;
+    for (unsigned i = 0; i < cache_nbufs && n < cache_ndirty; i++) {
+        struct cbuf *c = &cache_bufs[i];
+
+        if (c->flags & CBUF_DIRTY) {
+            pass[n] = cbuf_pass(c);
+            c->flags &= ~(CBUF_DIRTY | CBUF_DIRENT);
+            c->pins++;
+            memcpy(copy + (size_t)n * SFS_BLOCK_SIZE, cbuf_data(c),
+                   SFS_BLOCK_SIZE);
+            dirty[n++] = c;
+        }
+    }
+    cache_ndirty = 0;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    for (int p = 0; p < 3; p++) {
+        unsigned nreq = 0;
+
+        for (unsigned i = 0; i < n; i++) {
+            if (pass[i] != p) {
+                continue;
+            }
+            reqs[nreq].buf = copy + (size_t)i * SFS_BLOCK_SIZE;
+            reqs[nreq].size = SFS_BLOCK_SIZE;
+            reqs[nreq].offset = CACHE_BASE
+                                + (off_t)dirty[i]->blkno * SFS_BLOCK_SIZE;
+            reqs[nreq].write = 1;
+            nreq++;
+        }
+
+        if (backend == DISK_MMAP) {
+            raw_batch(reqs, nreq);
+        } else {
+            vector_batch(reqs, nreq);
+        }
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (unsigned i = 0; i < n; i++) {
+        dirty[i]->pins--;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_mutex_unlock(&flush_lock);
+
+    free(dirty);
+    free(reqs);
+    free(pass);
+    free(copy);
+}
+
+
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&flusher_lock);
+
+    while (!flusher_stop) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL;
+
+        if (pthread_cond_timedwait(&flusher_cond, &flusher_lock,
+                                   &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&flusher_lock);
+            cache_writeback();
+            pthread_mutex_lock(&flusher_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+
+/* Start the flusher thread when the first buffer gets dirty (so it is started
+ * after fuse has daemonized). Called with cache_lock held. */
+static void flusher_start(void)
+{
+    if (!flusher_running
+            && pthread_create(&flusher, NULL, flusher_main, NULL) == 0) {
+        flusher_running = 1;
+    }
+}
+
+
+static void flusher_join(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    int running = flusher_running;
+    flusher_running = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!running) {
+        return;
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+
+    pthread_join(flusher, NULL);
+}
+
+
+static void cache_batch_run(struct disk_req *reqs, unsigned n, int dirent)
+{
+    for (unsigned i = 0; i < n; i++) {
+        if (reqs[i].write) {
+            /* Checked here, before anything is submitted: in write-back
+             * mode the write may not reach raw_write for a long time. */
+            check_write_range(reqs[i].size, reqs[i].offset);
+            STAT_ADD(writes, 1);
+            STAT_ADD(write_bytes, reqs[i].size);
+        } else {
+            STAT_ADD(reads, 1);
+            STAT_ADD(read_bytes, reqs[i].size);
+        }
+    }
+
+    if (!cache_nbufs) {
+        raw_batch(reqs, n);
+        return;
+    }
+
+    struct cache_batch b;
+
+    pthread_mutex_lock(&cache_lock);
+
+    b.nraw = 0;
+    b.npend = 0;
+    b.gen = cache_write_gen;
+    b.dirent = dirent;
+
+    for (unsigned i = 0; i < n; i++) {
+        struct disk_req req = reqs[i];
+
+        /* Anything in front of the cached area goes straight to the image. */
+        if (req.offset < CACHE_BASE && req.size) {
+            size_t head = CACHE_BASE - req.offset;
+
+            if (head > req.size) {
+                head = req.size;
+            }
+            if (b.nraw == CACHE_RAW_MAX) {
+                cache_flush(&b);
+            }
+            cache_raw(&b, req.buf, head, req.offset, req.write);
+
+            req.buf = (char *)req.buf + head;
+            req.size -= head;
+            req.offset += head;
+        }
+
+        if (req.size) {
+            cache_req(&b, &req);
+        }
+    }
+
+    if (b.nraw || b.npend) {
+        cache_flush(&b);
+    }
+
+    int overDirty = cache_ndirty > cache_nbufs / 2;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if (overDirty) {
+        cache_writeback();
+    }
+}
+
+
+void disk_batch(struct disk_req *reqs, unsigned n)
+{
+    struct timespec start;
+    size_t bytes = 0;
+
+    op_stats_begin(&start);
+    cache_batch_run(reqs, n, 0);
+
+    for (unsigned i = 0; i < n; i++) {
+        bytes += reqs[i].size;
+    }
+    disk_op_end(DISK_OP_BATCH, &start, bytes);
+}
+
+
+void disk_prefetch(off_t offset, size_t size)
+{
+    struct disk_req reqs[CACHE_RAW_MAX];
+    struct cbuf *bufs[CACHE_RAW_MAX];
+
+    if (!cache_nbufs || offset < CACHE_BASE) {
+        return;
+    }
+
+    size_t blk = (offset - CACHE_BASE + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    size_t end = (offset + size - CACHE_BASE) / SFS_BLOCK_SIZE;
+    size_t loaded = 0;
+    struct timespec start;
+
+    op_stats_begin(&start);
+
+    while (blk < end) {
+        unsigned n = 0;
+
+        pthread_mutex_lock(&cache_lock);
+        unsigned long gen = cache_write_gen;
+
+        for (; blk < end && n < CACHE_RAW_MAX; blk++) {
+            struct cbuf *c = *cache_slot(blk);
+
+            if (c || !(c = cache_alloc(blk))) {
+                continue;
+            }
+            c->flags |= CBUF_BUSY;
+            c->pins++;
+
+            bufs[n] = c;
+            reqs[n].buf = cbuf_data(c);
+            reqs[n].size = SFS_BLOCK_SIZE;
+            reqs[n].offset = CACHE_BASE + (off_t)blk * SFS_BLOCK_SIZE;
+            reqs[n].write = 0;
+            n++;
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        if (backend == DISK_MMAP) {
+            raw_batch(reqs, n);
+        } else {
+            vector_batch(reqs, n);
+        }
+
+        pthread_mutex_lock(&cache_lock);
+        for (unsigned i = 0; i < n; i++) {
+            struct cbuf *c = bufs[i];
+
+            c->pins--;
+            if ((c->flags & CBUF_STALE) || gen != cache_write_gen) {
+                cache_drop(c);
+            } else {
+                /* Not referenced yet, so unused prefetches go first. */
+                c->flags = CBUF_HASHED | CBUF_VALID;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        loaded += n * SFS_BLOCK_SIZE;
+    }
+
+    disk_op_end(DISK_OP_PREFETCH, &start, loaded);
+}
+
+
+void disk_invalidate(off_t offset, size_t size)
+{
+    if (!cache_nbufs || size == 0 || offset + (off_t)size <= CACHE_BASE) {
+        return;
+    }
+    if (offset < CACHE_BASE) {
+        size -= CACHE_BASE - offset;
+        offset = CACHE_BASE;
+    }
+
+    size_t blk = (offset - CACHE_BASE) / SFS_BLOCK_SIZE;
+    size_t end = (offset + size - 1 - CACHE_BASE) / SFS_BLOCK_SIZE;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (; blk <= end; blk++) {
+        struct cbuf *c = *cache_slot(blk);
+
+        if (!c) {
+            continue;
+        }
+        if (c->flags & CBUF_BUSY) {
+            c->flags |= CBUF_STALE;
+        } else {
+            assert(!(c->flags & CBUF_DIRTY));
+            cache_drop(c);
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+void disk_get_stats(struct disk_stats *st)
+{
+    stats_sum(&disk_stats_set, st);
+}
+
+
+/* Largest copy done through the cache at a time, by disk_copy. */
+#define COPY_CHUNK  (1u << 20)
+
+void disk_copy(off_t dst, off_t src, size_t size)
+{
+    struct timespec start;
+    size_t done = 0;
+
+    op_stats_begin(&start);
+
+#ifdef SYS_copy_file_range
+    if (!cache_wb) {
+        while (done < size) {
+            loff_t in = src + done, out = dst + done;
+            ssize_t ret = syscall(SYS_copy_file_range, img_fd, &in, img_fd,
+                                  &out, size - done, 0);
+
+            STAT_ADD(syscalls, 1);
+            /* Not supported by the kernel or the file system, or the end
+             * of an image that mkfs left short: copy the rest below. */
+            if (ret <= 0) {
+                break;
+            }
+            done += ret;
+        }
+        if (done) {
+            STAT_ADD(reads, 1);
+            STAT_ADD(read_bytes, done);
+            STAT_ADD(writes, 1);
+            STAT_ADD(write_bytes, done);
+            disk_invalidate(dst, done);
+        }
+    }
+#endif
+
+    if (done < size) {
+        size_t chunk = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+        char *buf = malloc(chunk);
+
+        if (!buf) {
+            perror("Could not copy on disk");
+            exit(1);
+        }
+
+        while (done < size) {
+            size_t len = size - done < chunk ? size - done : chunk;
+            struct disk_req req = { buf, len, src + done, 0 };
+
+            cache_batch_run(&req, 1, 0);
+            req.offset = dst + done;
+            req.write = 1;
+            cache_batch_run(&req, 1, 0);
+            done += len;
+        }
+        free(buf);
+    }
+
+    disk_op_end(DISK_OP_COPY, &start, size);
+}
+
+
+int disk_fd(void)
+{
+    return cache_wb ? -1 : img_fd;
+}
+
+
+void disk_read(void *buf, size_t size, off_t offset)
+{
+    struct disk_req req = { buf, size, offset, 0 };
+    struct timespec start;
+
+    op_stats_begin(&start);
+    cache_batch_run(&req, 1, 0);
+    disk_op_end(DISK_OP_READ, &start, size);
+}
+
+
+void disk_write(const void *buf, size_t size, off_t offset)
+{
+    struct disk_req req = { (void *)buf, size, offset, 1 };
+    struct timespec start;
+
+    op_stats_begin(&start);
+    cache_batch_run(&req, 1, 0);
+    disk_op_end(DISK_OP_WRITE, &start, size);
+}
+
+
+void disk_write_dirent(const void *buf, size_t size, off_t offset)
+{
+    struct disk_req req = { (void *)buf, size, offset, 1 };
+    struct timespec start;
+
+    op_stats_begin(&start);
+    cache_batch_run(&req, 1, 1);
+    disk_op_end(DISK_OP_WRITE, &start, size);
+}
+
+
+void disk_barrier(void)
+{
+    if (cache_wb) {
+        cache_writeback();
+    }
+}
+
+
+void disk_sync(int wait)
+{
+    struct timespec start;
+    int ret = 0;
+
+    op_stats_begin(&start);
+
+    if (cache_wb) {
+        cache_writeback();
+    }
+
+    if (backend == DISK_MMAP) {
+        ret = msync(img_map, img_map_size, wait ? MS_SYNC : MS_ASYNC);
+        STAT_ADD(syscalls, 1);
+    } else if (wait) {
+        ret = fsync(img_fd);
+        STAT_ADD(syscalls, 1);
+    }
+
+    if (ret == -1) {
+        perror("Error syncing disk");
+        exit(1);
+    }
+
+    disk_op_end(DISK_OP_SYNC, &start, 0);
+}
+
 void disk_verify_magic(void)
 {
     char buf[SFS_MAGIC_SIZE];
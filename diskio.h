@@ -1,15 +1,173 @@
 #ifndef DISKIO_H
 #define DISKIO_H
 
+/*
+ * Select how the image is accessed: "pread" (the default) issues a
+ * pread/pwrite per access, "mmap" maps the whole image with MAP_SHARED and
+ * turns every access into a memcpy. Must be called before disk_open_image.
+ * Returns 0 on success, -1 if the name is not a known backend.
+ */
+int disk_set_backend(const char *name);
+
+/*
+ * Put a buffer cache of `size` bytes in front of the image, through which all
+ * reads and writes go from then on (see diskio.c). Writes are written through
+ * to the image immediately, unless `writeback` is set: then they are kept in
+ * the cache and only written back by disk_sync, disk_close_image, a background
+ * timer, or when the cache fills up. Must be called before disk_open_image;
+ * with a size of 0 (or without calling this at all) there is no cache.
+ */
+void disk_cache_init(size_t size, int writeback);
+
 /* Open a disk image for future disk operations. */
 void disk_open_image(const char *filename);
 
+/* Flush all writes to stable storage, and close the image. */
+void disk_close_image(void);
+
 /* Read `size` bytes from address `offset` of the disk, into `buf`. */
 void disk_read(void *buf, size_t size, off_t offset);
 
 /* Write `size` bytes from `buf` to disk at address `offset`. */
 void disk_write(const void *buf, size_t size, off_t offset);
 
+/* Load the blocks in `size` bytes at `offset` into the cache ahead of use, if
+ * there is a cache. Only whole blocks are loaded; cached blocks are skipped. */
+void disk_prefetch(off_t offset, size_t size);
+
+/* Like disk_write, for directory entries. With write-back caching these are
+ * written back only after data blocks and the block table. */
+void disk_write_dirent(const void *buf, size_t size, off_t offset);
+
+/*
+ * File descriptor of the image, for transferring data to or from it without
+ * going through disk_read/disk_write (e.g., with splice). Returns -1 while the
+ * image itself is not up to date, i.e., with a write-back cache. Writes made
+ * through the fd must be followed by disk_invalidate for the range written.
+ */
+int disk_fd(void);
+
+/* Drop any cached copies of the `size` bytes at `offset`, which were written
+ * to the image behind the cache's back. */
+void disk_invalidate(off_t offset, size_t size);
+/*
+ * Copy `size` bytes of the image from offset `src` to offset `dst`; the two
+ * ranges must not overlap. Without a write-back cache the kernel copies the
+ * data within the image file (copy_file_range), so it never passes through
+ * this process, and cached copies of the destination are dropped. Otherwise,
+ * or where the kernel cannot do it, the data is copied through the cache in
+ * large chunks.
+ */
+void disk_copy(off_t dst, off_t src, size_t size);
+
+/* One read or write in a batch submitted with disk_batch. */
+struct disk_req {
+    void *buf;
+    size_t size;
+    off_t offset;
+    int write;
+};
+
+/*
+ * Perform all `n` requests and return once every one of them has completed.
+ * Requests may complete in any order, so they must not overlap each other.
+ * With the pread backend the batch is submitted through io_uring with a single
+ * syscall where the kernel allows it, and otherwise with one preadv/pwritev
+ * per run of adjacent requests.
+ */
+void disk_batch(struct disk_req *reqs, unsigned n);
+
+/* Make everything written so far reach the image before anything written
+ * after this returns. Only needed, and only does anything, with a write-back
+ * cache, which otherwise orders its writes as described in diskio.c. */
+void disk_barrier(void);
+
+/* Push written data towards stable storage. Anything still held in a
+ * write-back cache is written to the image first. If `wait` is set this blocks
+ * until everything written so far is durable, otherwise it only initiates
+ * writeback. */
+void disk_sync(int wait);
+
+/*
+ * Per-thread statistics, used for the counters below and by sfs.c. A stats set
+ * gives every thread its own area of `size` bytes of unsigned long counters,
+ * which only that thread updates (with STATS_ADD), so counting needs neither
+ * locks nor atomic read-modify-writes. Readers add up the areas of all threads
+ * with stats_sum. The area of a thread that exits is handed to the next new
+ * thread, so nothing that was counted is ever lost.
+ */
+struct stats_set;
+
+/* Create a set with areas of `size` bytes (a multiple of unsigned long). */
+struct stats_set *stats_set_new(size_t size);
+
+/* The calling thread's area of `set`, all zero at first. Returns NULL if no
+ * area could be allocated. */
+void *stats_local(struct stats_set *set);
+
+/* Store the sum of the areas of all threads in `sum`. */
+void stats_sum(struct stats_set *set, void *sum);
+
+/* Call `fn` for the area of every thread that has one (and of threads that
+ * have exited), with `arg`. New threads wait until this returns. */
+void stats_each(struct stats_set *set, void (*fn)(void *area, void *arg),
+                void *arg);
+
+/* Add `n` to a counter in the calling thread's own area. */
+#define STATS_ADD(var, n) \
+    __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+/* Latency histogram buckets: bucket i counts calls that took less than 2^i
+ * nanoseconds (and at least 2^(i-1)); the last one also counts anything
+ * slower. */
+#define OP_STATS_BUCKETS    36
+
+/* Counters for one kind of operation. */
+struct op_stats {
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long bytes;
+    unsigned long ns;           /* Total time taken */
+    unsigned long hist[OP_STATS_BUCKETS];
+};
+
+/* Note the start of an operation in `start`. */
+void op_stats_begin(struct timespec *start);
+
+/* Count an operation that started at `start` and moved `bytes` bytes, in the
+ * calling thread's own `st`. Returns the time it took in nanoseconds. */
+unsigned long op_stats_end(struct op_stats *st, const struct timespec *start,
+                           size_t bytes, int error);
+
+/* Upper bound in nanoseconds of the latency of `pct` percent of the calls. */
+unsigned long op_stats_percentile(const struct op_stats *st, unsigned pct);
+
+/* Timed disk operations. */
+enum disk_op {
+    DISK_OP_READ,               /* disk_read */
+    DISK_OP_WRITE,              /* disk_write, disk_write_dirent */
+    DISK_OP_BATCH,              /* disk_batch */
+    DISK_OP_PREFETCH,           /* disk_prefetch */
+    DISK_OP_SYNC,               /* disk_sync */
+    DISK_OP_COPY,               /* disk_copy */
+    DISK_NOPS
+};
+
+/* Counters of the I/O done since the image was opened. */
+struct disk_stats {
+    unsigned long reads;        /* Read requests (disk_read, disk_batch) */
+    unsigned long writes;       /* Write requests */
+    unsigned long read_bytes;
+    unsigned long write_bytes;
+    unsigned long syscalls;     /* System calls made on the image */
+    unsigned long cache_hits;   /* Blocks read from the cache */
+    unsigned long cache_misses; /* Blocks read from the image past the cache */
+    struct op_stats ops[DISK_NOPS];
+};
+
+/* Add up the I/O counters of all threads. */
+void disk_get_stats(struct disk_stats *st);
+
 /* Verify this is an SFS partitiion by checking the magic bytes at the start. */
 void disk_verify_magic(void);
 
@@ -1,7 +1,9 @@
 #define FUSE_USE_VERSION 26
 
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -9,6 +11,10 @@
 #include <unistd.h>
 #include <assert.h>
 #include <time.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "sfs.h"
 #include "diskio.h"
@@ -16,9 +22,33 @@
 
 static const char default_img[] = "test.img";
 
+/* Size of the block cache (see diskio.c) unless --cache-mb is given. */
+#define DEFAULT_CACHE_MB    16u
+
+/* Defaults of the switches for caching in the kernel (see conn_init): how
+ * long it may cache attributes and lookups, in seconds, and the largest read
+ * and write requests it sends. */
+#define DEFAULT_TIMEOUT     60.0
+#define DEFAULT_MAX_IO      (128u * 1024)
+
 /* Options passed from commandline argumentss */
 struct options {
     const char *img;
+    const char *io;
+    unsigned cache_mb;
+    int writeback;
+    double attr_timeout;
+    double entry_timeout;
+    int kernel_cache;
+    unsigned max_write;
+    unsigned max_read;
+    int writeback_cache;
+    const char *stats;
+    const char *trace;
+    const char *capture;
+    const char *replay;
+    int replay_timing;
+    int lowlevel;
     int background;
     int verbose;
     int show_help;
@@ -26,644 +56,5251 @@ struct options {
 } options;
 
 
-#define log(fmt, ...) \
-    do { \
-        if (options.verbose) \
-            printf(" # " fmt, ##__VA_ARGS__); \
-    } while (0)
-
-
 /* libfuse2 leaks, so let's shush LeakSanitizer if we are using Asan. */
 const char* __asan_default_options() { return "detect_leaks=0"; }
 
 
 
-static blockidx_t get_next(blockidx_t current) {
-    blockidx_t next;
+/*
+ * In-memory mirror of the on-disk block table. It is loaded once at mount by
+ * blocktbl_load(), after which all lookups are served from RAM. Every update
+ * is passed on to the disk layer immediately with blocktbl_sync, so the disk
+ * stays authoritative and the image is consistent even if the driver is
+ * killed (unless write-back caching was asked for).
+ */
+static blockidx_t blocktbl[SFS_BLOCKTBL_NENTRIES];
+
 
-    off_t offset = SFS_BLOCKTBL_OFF + (current * sizeof(blockidx_t));
-    disk_read(&next, sizeof(blockidx_t), offset);
-    return next;
+static void blocktbl_load(void)
+{
+    disk_read(blocktbl, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
 }
 
 
-static void set_next(blockidx_t current, blockidx_t nextVal) {
-    off_t offset = SFS_BLOCKTBL_OFF + (current * sizeof(blockidx_t));
-    disk_write(&nextVal, sizeof(blockidx_t), offset);
+static blockidx_t get_next(blockidx_t current) {
+    if (current >= SFS_BLOCKTBL_NENTRIES) {
+        return SFS_BLOCKIDX_END;
+    }
+    return blocktbl[current];
 }
 
 
-static blockidx_t free_blk() {
-    blockidx_t entry;
+/* Maximum number of requests gathered for a single disk_batch. */
+#define IO_BATCH    256u
+
+
+static int blockidx_cmp(const void *a, const void *b)
+{
+    return *(const blockidx_t *)a - *(const blockidx_t *)b;
+}
+
 
-    for (int i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+/*
+ * Write the block table entries of the `n` (at most IO_BATCH) blocks in `blks`
+ * through to disk as one batch. Entries that are adjacent in the table are
+ * merged into a single write, so relinking a contiguous run of blocks costs
+ * one write. The entries must already be updated in blocktbl. Sorts `blks`.
+ */
+static void blocktbl_sync(blockidx_t *blks, unsigned n)
+{
+    struct disk_req reqs[IO_BATCH];
+    unsigned nreq = 0;
 
-        off_t offset = SFS_BLOCKTBL_OFF + (i * sizeof(blockidx_t));
+    assert(n <= IO_BATCH);
+    qsort(blks, n, sizeof(blockidx_t), blockidx_cmp);
 
-        disk_read(&entry, sizeof(blockidx_t), offset);
+    for (unsigned i = 0; i < n; ) {
+        unsigned len = 1;
 
-        if (entry == SFS_BLOCKIDX_EMPTY) {
-            return (blockidx_t)i;
+        while (i + len < n && blks[i + len] == blks[i] + len) {
+            len++;
         }
+
+        reqs[nreq].buf = &blocktbl[blks[i]];
+        reqs[nreq].size = len * sizeof(blockidx_t);
+        reqs[nreq].offset = SFS_BLOCKTBL_OFF + blks[i] * sizeof(blockidx_t);
+        reqs[nreq].write = 1;
+        nreq++;
+
+        i += len;
     }
-    return SFS_BLOCKIDX_END;
+
+    disk_batch(reqs, nreq);
 }
 
+
 /*
- * This is a helper function that is optional, but highly recomended you
- * implement and use. Given a path, it looks it up on disk. It will return 0 on
- * success, and a non-zero value on error (e.g., the file did not exist).
- * The resulting directory entry is placed in the memory pointed to by
- * ret_entry. Additionally it can return the offset of that direntry on disk in
- * ret_entry_off, which you can use to update the entry and write it back to
- * disk (e.g., rmdir, unlink, truncate, write).
- *
- * You can start with implementing this function to work just for paths in the
- * root entry, and later modify it to also work for paths with subdirectories.
- * This way, all of your other functions can use this helper and will
- * automatically support subdirectories. To make this function support
- * subdirectories, we recommend you refactor this function to be recursive, and
- * take the current directory as argument as well. For example:
- *
- *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
- *                           size_t parent_nentries, blockidx_t parent_blockidx,
- *                           struct sfs_entry *ret_entry,
- *                           unsigned *ret_entry_off)
+ * Block allocator. A bitmap of free blocks (bit set = block free) is built
+ * from the block table at mount, so allocation never has to scan the table
+ * itself. Free blocks are found a 64-bit word at a time with ctz, and whole
+ * runs of consecutive blocks can be handed out in one call so that large files
+ * stay mostly sequential on disk. The allocator only tracks ownership: callers
+ * are responsible for linking the blocks they get into a chain (see
+ * chain_extend).
  *
- * Here parent is the directory it is currently searching (at first the rootdir,
- * later the subdir). The parent_nentries tells the function how many entries
- * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
- * Finally, the parent_blockidx contains the blockidx of the given directory on
- * the disk, which will help in calculating ret_entry_off.
+ * The bitmap is protected by alloc_lock, so concurrent allocations never hand
+ * out the same block. Once allocated, a block's block table entry is only
+ * touched by the thread that owns it, so linking it needs no locking.
  */
-static int get_entry(const char *path, struct sfs_entry *ret_entry,
-                     unsigned *ret_entry_off)
+#define FREEMAP_WORDS   (SFS_BLOCKTBL_NENTRIES / 64)
+
+static uint64_t freemap[FREEMAP_WORDS];
+static unsigned free_count;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void alloc_init(void)
 {
-    char *copy = strdup(path);
-    char *token = strtok(copy, "/");
-    int found;
-    unsigned int dirOff = SFS_ROOTDIR_OFF;
-    int dirEntries = SFS_ROOTDIR_NENTRIES;
-    struct sfs_entry entry;
+    memset(freemap, 0, sizeof(freemap));
+
+    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        if (blocktbl[i] == SFS_BLOCKIDX_EMPTY) {
+            freemap[i / 64] |= 1ull << (i % 64);
+        }
+    }
 
-    while (token != NULL) {
-        found = 0;
+    free_count = 0;
+    for (unsigned w = 0; w < FREEMAP_WORDS; w++) {
+        free_count += __builtin_popcountll(freemap[w]);
+    }
+}
 
-        for (int i = 0; i < dirEntries; i++) { 
-            unsigned int entryDiskOff = 0;
 
-            if (dirOff == SFS_ROOTDIR_OFF) {
+/* Index of the first free (want_free) or used (!want_free) block >= from, or
+ * SFS_BLOCKTBL_NENTRIES if there is none. */
+static unsigned freemap_scan(unsigned from, int want_free)
+{
+    unsigned w = from / 64;
 
-                entryDiskOff = SFS_ROOTDIR_OFF + (i * sizeof(struct sfs_entry));
-                disk_read(&entry, sizeof(struct sfs_entry), entryDiskOff);
-            } else {
-                blockidx_t blk = (blockidx_t)dirOff;
-                
-                if (i >= 8) {
-                    blk = get_next(blk);
-                }
-                
-                int indexInblk = i % 8;
-                entryDiskOff = SFS_DATA_OFF + (blk * SFS_BLOCK_SIZE) + (indexInblk * sizeof(struct sfs_entry));
-                
-                disk_read(&entry, sizeof(struct sfs_entry), entryDiskOff);
+    if (from >= SFS_BLOCKTBL_NENTRIES) {
+        return SFS_BLOCKTBL_NENTRIES;
+    }
+
+    uint64_t bits = want_free ? freemap[w] : ~freemap[w];
+    bits &= ~0ull << (from % 64);
+
+    while (!bits) {
+        if (++w == FREEMAP_WORDS) {
+            return SFS_BLOCKTBL_NENTRIES;
+        }
+        bits = want_free ? freemap[w] : ~freemap[w];
+    }
+
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+
+static void freemap_set(unsigned start, unsigned n, int free)
+{
+    for (unsigned i = start; i < start + n; i++) {
+        if (free) {
+            freemap[i / 64] |= 1ull << (i % 64);
+        } else {
+            freemap[i / 64] &= ~(1ull << (i % 64));
+        }
+    }
+    if (free) {
+        free_count += n;
+    } else {
+        free_count -= n;
+    }
+}
+
+
+/*
+ * Allocate a run of up to `want` consecutive blocks. If `goal` is a free block
+ * the run starts there (useful to extend a file in place), otherwise the first
+ * run of at least `want` blocks is used, falling back to the longest run
+ * available. The number of blocks actually allocated is stored in ret_n.
+ * Returns the first block of the run, or SFS_BLOCKIDX_END if the disk is full.
+ */
+static blockidx_t alloc_run(blockidx_t goal, unsigned want,
+                            unsigned *ret_n)
+{
+    unsigned best = SFS_BLOCKTBL_NENTRIES, best_len = 0;
+    unsigned pos = 0;
+
+    *ret_n = 0;
+    if (want == 0) {
+        return SFS_BLOCKIDX_END;
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+
+    if (goal < SFS_BLOCKTBL_NENTRIES && freemap_scan(goal, 1) == goal) {
+        best = goal;
+        best_len = freemap_scan(goal, 0) - goal;
+    }
+
+    while (best_len < want) {
+        unsigned start = freemap_scan(pos, 1);
+        if (start == SFS_BLOCKTBL_NENTRIES) {
+            break;
+        }
+
+        unsigned end = freemap_scan(start, 0);
+        if (end - start > best_len) {
+            best = start;
+            best_len = end - start;
+        }
+        pos = end;
+    }
+
+    if (best_len > want) {
+        best_len = want;
+    }
+
+    if (best_len) {
+        freemap_set(best, best_len, 0);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    *ret_n = best_len;
+    return best_len ? (blockidx_t)best : SFS_BLOCKIDX_END;
+}
+
+
+/* Return `n` consecutive blocks starting at `start` to the allocator. */
+static void alloc_release(blockidx_t start, unsigned n)
+{
+    pthread_mutex_lock(&alloc_lock);
+    freemap_set(start, n, 1);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+
+/* Number of free blocks, kept up to date by alloc_run and alloc_release. */
+static unsigned alloc_nfree(void)
+{
+    pthread_mutex_lock(&alloc_lock);
+    unsigned n = free_count;
+    pthread_mutex_unlock(&alloc_lock);
+
+    return n;
+}
+
+
+/*
+ * Mark every block in the chain starting at `blk` as unused, and make `last`
+ * (unless it is SFS_BLOCKIDX_END) the new end of the chain it belonged to. The
+ * block table is updated in batches of IO_BATCH entries, each written with one
+ * disk_batch, the first of which also holds the entry of `last`. Blocks are
+ * only returned to the allocator once their entries are on disk, so a new
+ * owner's links can never be overwritten by a stale write. Whatever stopped
+ * referring to the blocks (a cleared or shrunk directory entry) must already
+ * have been written; a write-back cache is made to write it first.
+ */
+static void free_chain_after(blockidx_t last, blockidx_t blk)
+{
+    blockidx_t blks[IO_BATCH];
+    unsigned n = 0;
+
+    disk_barrier();
+
+    if (last < SFS_BLOCKTBL_NENTRIES) {
+        blocktbl[last] = SFS_BLOCKIDX_END;
+        blks[n++] = last;
+    }
+
+    while (n || blk < SFS_BLOCKTBL_NENTRIES) {
+        while (n < IO_BATCH && blk < SFS_BLOCKTBL_NENTRIES) {
+            blockidx_t next = blocktbl[blk];
+
+            blocktbl[blk] = SFS_BLOCKIDX_EMPTY;
+            blks[n++] = blk;
+            blk = next;
+        }
+
+        blocktbl_sync(blks, n);
+
+        for (unsigned i = 0; i < n; ) {
+            unsigned len = 1;
+
+            if (blks[i] == last) {
+                i++;
+                continue;
             }
+            while (i + len < n && blks[i + len] == blks[i] + len
+                    && blks[i + len] != last) {
+                len++;
+            }
+            alloc_release(blks[i], len);
+            i += len;
+        }
 
-            if (strlen(entry.filename) > 0 && strcmp(entry.filename, token) == 0) {
-                found = 1;
+        n = 0;
+    }
+}
 
-                if (ret_entry){
-                    *ret_entry = entry;
-                }
 
-                if (ret_entry_off){
-                    *ret_entry_off = entryDiskOff;
-                }
-                
-                token = strtok(NULL, "/");
-                
-                if (token != NULL) {
-                    dirOff = entry.first_block;
-                    dirEntries = SFS_DIR_NENTRIES;
-                }
-                break;
+/* Mark every block in the chain starting at `blk` as unused. */
+static void free_chain(blockidx_t blk)
+{
+    free_chain_after(SFS_BLOCKIDX_END, blk);
+}
+
+/*
+ * Length (in blocks, at most `max`) of the run of physically consecutive
+ * blocks starting at `blk` in its chain. The block that follows the run in the
+ * chain is stored in ret_next.
+ */
+static unsigned chain_extent(blockidx_t blk, unsigned max,
+                             blockidx_t *ret_next)
+{
+    unsigned n = 1;
+    blockidx_t next = get_next(blk);
+
+    while (n < max && next == blk + 1) {
+        blk = next;
+        next = get_next(blk);
+        n++;
+    }
+
+    *ret_next = next;
+    return n;
+}
+
+
+/*
+ * Position in a block chain: `blk` is the block at index `idx` of the chain.
+ * Open files keep one around so sequential accesses resume where the previous
+ * one stopped instead of walking the chain from the start.
+ */
+struct chain_pos {
+    blockidx_t blk;
+    unsigned idx;
+};
+
+
+/*
+ * Return the block at index `idx` of the chain starting at `first`. If `pos`
+ * is given and lies at or before `idx`, the walk starts from there, and it is
+ * updated to point at the returned block.
+ */
+static blockidx_t chain_seek(blockidx_t first, unsigned idx,
+                             struct chain_pos *pos)
+{
+    blockidx_t blk = first;
+    unsigned cur = 0;
+
+    if (pos && pos->idx <= idx && pos->blk < SFS_BLOCKTBL_NENTRIES) {
+        blk = pos->blk;
+        cur = pos->idx;
+    }
+
+    for (; cur < idx && blk < SFS_BLOCKTBL_NENTRIES; cur++) {
+        blk = get_next(blk);
+    }
+
+    if (pos && blk < SFS_BLOCKTBL_NENTRIES) {
+        pos->blk = blk;
+        pos->idx = idx;
+    }
+    return blk;
+}
+
+
+/*
+ * Append up to `n` newly allocated blocks to the chain that starts at *first
+ * and ends at *tail (both SFS_BLOCKIDX_END for an empty chain). Blocks are
+ * taken from the allocator as runs of consecutive blocks, preferably starting
+ * right after the tail so the file stays sequential on disk. Each run is
+ * written to the block table with one request, merged with the entry of the
+ * block it is linked from where they are adjacent, and the requests of all
+ * runs are submitted as one batch.
+ * Returns the number of blocks appended, which is less than `n` only if the
+ * disk is full. *first and *tail are updated.
+ */
+static unsigned chain_extend(blockidx_t *first, blockidx_t *tail, unsigned n)
+{
+    struct disk_req reqs[IO_BATCH];
+    unsigned nreq = 0;
+    unsigned added = 0;
+
+    while (added < n) {
+        unsigned len;
+        blockidx_t goal = *tail < SFS_BLOCKTBL_NENTRIES ? *tail + 1
+                                                        : SFS_BLOCKIDX_END;
+        blockidx_t start = alloc_run(goal, n - added, &len);
+
+        if (len == 0) {
+            break;
+        }
+
+        for (unsigned i = 0; i + 1 < len; i++) {
+            blocktbl[start + i] = start + i + 1;
+        }
+        blocktbl[start + len - 1] = SFS_BLOCKIDX_END;
+
+        /* The tail's entry is already part of the last request unless the
+         * batch is empty. */
+        blockidx_t from = start;
+        if (*tail < SFS_BLOCKTBL_NENTRIES) {
+            blocktbl[*tail] = start;
+            if (nreq == 0 && *tail + 1 == start) {
+                from = *tail;
+            } else if (nreq == 0) {
+                reqs[nreq].buf = &blocktbl[*tail];
+                reqs[nreq].size = sizeof(blockidx_t);
+                reqs[nreq].offset = SFS_BLOCKTBL_OFF
+                                    + *tail * sizeof(blockidx_t);
+                reqs[nreq].write = 1;
+                nreq++;
             }
+        } else {
+            *first = start;
         }
 
-        if (!found) {
-            return -ENOENT;
+        off_t fromOff = SFS_BLOCKTBL_OFF + from * sizeof(blockidx_t);
+        size_t size = (start + len - from) * sizeof(blockidx_t);
+
+        if (nreq && reqs[nreq - 1].offset
+                    + (off_t)reqs[nreq - 1].size == fromOff) {
+            reqs[nreq - 1].size += size;
+        } else {
+            reqs[nreq].buf = &blocktbl[from];
+            reqs[nreq].size = size;
+            reqs[nreq].offset = fromOff;
+            reqs[nreq].write = 1;
+            nreq++;
         }
+
+        /* Keep room for the next run's two requests. */
+        if (nreq + 2 > IO_BATCH) {
+            disk_batch(reqs, nreq);
+            nreq = 0;
+        }
+
+        *tail = start + len - 1;
+        added += len;
     }
 
-    return 0;
+    if (nreq) {
+        disk_batch(reqs, nreq);
+    }
+
+    return added;
 }
 
+
 /*
- * Retrieve information about a file or directory.
- * You should populate fields of `st` with appropriate information if the
- * file exists and is accessible, or return an error otherwise.
- *
- * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
- * For files, you should at least set st_mode (with S_IFREG), st_nlink and
- * st_size.
+ * Cut the chain starting at *first after block `last`, freeing everything
+ * that follows it with the same batched table updates as free_chain. If
+ * `last` is SFS_BLOCKIDX_END the whole chain is freed and *first becomes
+ * SFS_BLOCKIDX_END.
+ */
+static void chain_cut(blockidx_t *first, blockidx_t last)
+{
+    if (last >= SFS_BLOCKTBL_NENTRIES) {
+        free_chain(*first);
+        *first = SFS_BLOCKIDX_END;
+    } else if (blocktbl[last] < SFS_BLOCKTBL_NENTRIES) {
+        free_chain_after(last, blocktbl[last]);
+    }
+}
+
+
+/* Source of the zeroes written by chain_io when no buffer is given. */
+#define ZERO_BUF_SIZE   (64u * 1024)
+
+static char zero_buf[ZERO_BUF_SIZE];
+
+
+/* A range of consecutive bytes of the image. */
+struct chain_ext {
+    off_t offset;
+    size_t size;
+};
+
+
+/*
+ * Resolve `size` bytes at `offset` of the data in the chain starting at
+ * `first` into at most `max` extents of consecutive blocks, stored in `ext`.
+ * `pos` is an optional cursor, which is left at the last block resolved. The
+ * number of bytes covered is stored in ret_size, which is less than `size` if
+ * the chain is too short or the range needs more than `max` extents.
+ * Returns the number of extents.
+ */
+static unsigned chain_map(blockidx_t first, size_t size, off_t offset,
+                          struct chain_pos *pos, struct chain_ext *ext,
+                          unsigned max, size_t *ret_size)
+{
+    unsigned n = 0;
+    size_t done = 0;
+    size_t inBlk = offset % SFS_BLOCK_SIZE;
+    unsigned idx = offset / SFS_BLOCK_SIZE;
+
+    blockidx_t blk = chain_seek(first, idx, pos);
+
+    while (done < size && n < max && blk < SFS_BLOCKTBL_NENTRIES) {
+        size_t left = size - done;
+        unsigned maxBlks = (inBlk + left + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+        blockidx_t next;
+        unsigned nblks = chain_extent(blk, maxBlks, &next);
+
+        size_t len = nblks * SFS_BLOCK_SIZE - inBlk;
+        if (len > left) {
+            len = left;
+        }
+
+        ext[n].offset = SFS_DATA_OFF + blk * SFS_BLOCK_SIZE + inBlk;
+        ext[n].size = len;
+        n++;
+
+        if (pos) {
+            pos->blk = blk + nblks - 1;
+            pos->idx = idx + nblks - 1;
+        }
+
+        done += len;
+        inBlk = 0;
+        idx += nblks;
+        blk = next;
+    }
+
+    *ret_size = done;
+    return n;
+}
+
+
+/*
+ * Transfer `size` bytes at `offset` of the data in the chain starting at
+ * `first`, to (`write` == 0) or from `buf`. Writing with a NULL `buf` fills
+ * the range with zeroes. The chain must be long enough to hold the range.
  *
- * Return 0 on success, < 0 on error.
+ * The chain is resolved into extents of consecutive blocks (see chain_map),
+ * and all extents are then transferred with a single disk_batch, one request
+ * per extent, directly from or into `buf`. `pos` is an optional cursor, which
+ * is left at the last block transferred.
+ * Returns the number of bytes transferred.
  */
-static int sfs_getattr(const char *path,
-                       struct stat *st)
+static size_t chain_io(blockidx_t first, char *buf, size_t size, off_t offset,
+                       int write, struct chain_pos *pos)
 {
-    log("getattr %s\n", path);
+    struct disk_req reqs[IO_BATCH];
+    struct chain_ext ext[IO_BATCH];
+    struct chain_pos tmpPos = { SFS_BLOCKIDX_END, 0 };
+    unsigned nreq = 0;
+    size_t done = 0;
+
+    if (!pos) {
+        pos = &tmpPos;
+    }
 
-    memset(st, 0, sizeof(struct stat));
-   
-    if (strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
+    while (done < size) {
+        size_t mapped;
+        unsigned n = chain_map(first, size - done, offset + done, pos, ext,
+                               IO_BATCH, &mapped);
+
+        if (n == 0) {
+            break;
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            for (size_t part = 0; part < ext[i].size; ) {
+                size_t partLen = ext[i].size - part;
+
+                if (!buf && partLen > ZERO_BUF_SIZE) {
+                    partLen = ZERO_BUF_SIZE;
+                }
+
+                reqs[nreq].buf = buf ? buf + done + part : zero_buf;
+                reqs[nreq].size = partLen;
+                reqs[nreq].offset = ext[i].offset + part;
+                reqs[nreq].write = write;
+                if (++nreq == IO_BATCH) {
+                    disk_batch(reqs, nreq);
+                    nreq = 0;
+                }
+
+                part += partLen;
+            }
+            done += ext[i].size;
+        }
+    }
+
+    if (nreq) {
+        disk_batch(reqs, nreq);
+    }
+
+    return done;
+}
+
+
+/*
+ * Read up to `size` bytes at `offset` from a file of `fsize` bytes whose data
+ * starts at block `first`, with a cursor `pos` as for chain_io.
+ * Returns the number of bytes read.
+ */
+static int read_chain(blockidx_t first, size_t fsize, char *buf, size_t size,
+                      off_t offset, struct chain_pos *pos)
+{
+    if ((size_t)offset >= fsize) {
         return 0;
     }
+    if (size > fsize - offset) {
+        size = fsize - offset;
+    }
+
+    return chain_io(first, buf, size, offset, 0, pos);
+}
+
+/* Key used for the root directory wherever directories are identified by
+ * their first block. */
+#define DIR_ROOT    SFS_BLOCKIDX_EMPTY
 
+
+/*
+ * Dentry cache. Maps (parent directory, name) to the directory entry and its
+ * disk offset, so repeated lookups of the same path never touch the disk.
+ * Directories are identified by their first block (DIR_ROOT for the root).
+ * Failed lookups are cached as negative entries.
+ *
+ * Entries live in a fixed pool and are recycled in LRU order. Every operation
+ * that adds or removes a directory entry updates the cache for exactly that
+ * (parent, name) pair.
+ *
+ * dcache_lock protects the cache itself. To keep the cache consistent with
+ * the disk, entries for a directory are only ever inserted while holding that
+ * directory's lock (see dir_lock): for reading when caching what was just read
+ * from disk, for writing when the directory is being modified.
+ *
+ * Writes change the size and first block of an open file's entry without
+ * taking its directory lock. They update the cached copy through a second
+ * hash keyed by disk offset (dcache_update), which also bumps dcache_gen.
+ * Entries read from disk are only cached if dcache_gen did not change since
+ * before the read, so a stale copy can never replace a fresh one.
+ */
+#define DCACHE_SIZE     4096u
+#define DCACHE_BUCKETS  8192u
+
+struct dentry {
+    blockidx_t parent;
+    char name[SFS_FILENAME_MAX];
+    int negative;
+    unsigned entry_off;
     struct sfs_entry entry;
+    struct dentry *hnext, *ohnext;
+    struct dentry *lru_prev, *lru_next;
+};
 
-    int res = 0;
-    res = get_entry(path, &entry, NULL);
-    
-    if (res != 0){
-        return res;
-    }
+static struct dentry dcache_pool[DCACHE_SIZE];
+static struct dentry *dcache_name_hash[DCACHE_BUCKETS];
+static struct dentry *dcache_off_hash[DCACHE_BUCKETS];
+static struct dentry dcache_lru = { .lru_prev = &dcache_lru,
+                                    .lru_next = &dcache_lru };
+static unsigned dcache_used;
+static unsigned dcache_gen;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (entry.size & SFS_DIRECTORY) {
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
-        st->st_size = 0;
+
+static unsigned dcache_hash(blockidx_t parent, const char *name)
+{
+    unsigned h = 2166136261u ^ parent;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h % DCACHE_BUCKETS;
+}
+
+
+static struct dentry **dcache_name_slot(blockidx_t parent, const char *name)
+{
+    struct dentry **dp = &dcache_name_hash[dcache_hash(parent, name)];
+
+    while (*dp && ((*dp)->parent != parent || strcmp((*dp)->name, name))) {
+        dp = &(*dp)->hnext;
+    }
+    return dp;
+}
+
+
+static struct dentry **dcache_off_slot(unsigned entry_off)
+{
+    struct dentry **dp = &dcache_off_hash[(entry_off / sizeof(struct sfs_entry))
+                                          % DCACHE_BUCKETS];
+
+    while (*dp && (*dp)->entry_off != entry_off) {
+        dp = &(*dp)->ohnext;
+    }
+    return dp;
+}
+
+
+static void dcache_lru_unlink(struct dentry *d)
+{
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+}
+
+
+static void dcache_lru_push(struct dentry *d)
+{
+    d->lru_next = dcache_lru.lru_next;
+    d->lru_prev = &dcache_lru;
+    dcache_lru.lru_next->lru_prev = d;
+    dcache_lru.lru_next = d;
+}
+
+
+static void dcache_remove(struct dentry *d)
+{
+    *dcache_name_slot(d->parent, d->name) = d->hnext;
+    if (!d->negative) {
+        *dcache_off_slot(d->entry_off) = d->ohnext;
+    }
+    dcache_lru_unlink(d);
+}
+
+
+/* Result of dcache_lookup for names that are not in the cache. */
+#define DCACHE_MISS 1
+
+
+/*
+ * Look up `name` in directory `parent`. Returns 0 and fills ret_entry and
+ * ret_entry_off if it is cached as existing, -ENOENT if it is cached as not
+ * existing, and DCACHE_MISS if it is not cached.
+ */
+static int dcache_lookup(blockidx_t parent, const char *name,
+                         struct sfs_entry *ret_entry, unsigned *ret_entry_off)
+{
+    int res = DCACHE_MISS;
+
+    pthread_mutex_lock(&dcache_lock);
+
+    struct dentry *d = *dcache_name_slot(parent, name);
+
+    if (d) {
+        dcache_lru_unlink(d);
+        dcache_lru_push(d);
+
+        if (d->negative) {
+            res = -ENOENT;
+        } else {
+            *ret_entry = d->entry;
+            *ret_entry_off = d->entry_off;
+            res = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+    return res;
+}
+
+
+/* Current generation of the cache, to be passed to dcache_fill. */
+static unsigned dcache_snapshot(void)
+{
+    pthread_mutex_lock(&dcache_lock);
+    unsigned gen = dcache_gen;
+    pthread_mutex_unlock(&dcache_lock);
+    return gen;
+}
+
+
+static void dcache_insert_locked(blockidx_t parent, const char *name,
+                                 const struct sfs_entry *entry,
+                                 unsigned entry_off)
+{
+    struct dentry *d = *dcache_name_slot(parent, name);
+
+    if (d) {
+        dcache_remove(d);
+    } else if (dcache_used < DCACHE_SIZE) {
+        d = &dcache_pool[dcache_used++];
     } else {
-        st->st_mode = S_IFREG | 0644;
-        st->st_nlink = 1;
-        st->st_size = entry.size & SFS_SIZEMASK;
+        d = dcache_lru.lru_prev;
+        dcache_remove(d);
+    }
+
+    d->parent = parent;
+    strcpy(d->name, name);
+    d->negative = entry == NULL;
+
+    struct dentry **dp = dcache_name_slot(parent, name);
+    d->hnext = *dp;
+    *dp = d;
+
+    if (entry) {
+        d->entry = *entry;
+        d->entry_off = entry_off;
+
+        dp = dcache_off_slot(entry_off);
+        if (*dp) {
+            /* The slot was reused under a different name. */
+            dcache_remove(*dp);
+            dp = dcache_off_slot(entry_off);
+        }
+        d->ohnext = *dp;
+        *dp = d;
+    }
+
+    dcache_lru_push(d);
+}
+
+
+/* Record that `name` in directory `parent` refers to `entry`, stored at disk
+ * offset `entry_off`, or that it does not exist if `entry` is NULL. */
+static void dcache_insert(blockidx_t parent, const char *name,
+                          const struct sfs_entry *entry, unsigned entry_off)
+{
+    pthread_mutex_lock(&dcache_lock);
+    dcache_insert_locked(parent, name, entry, entry_off);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/* Like dcache_insert, for an entry read from disk after dcache_snapshot
+ * returned `gen`. Nothing is cached if an entry was updated since. */
+static void dcache_fill(blockidx_t parent, const char *name,
+                        const struct sfs_entry *entry, unsigned entry_off,
+                        unsigned gen)
+{
+    pthread_mutex_lock(&dcache_lock);
+    if (gen == dcache_gen) {
+        dcache_insert_locked(parent, name, entry, entry_off);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/* The entry at disk offset `entry_off` was changed in place to `entry`. */
+static void dcache_update(unsigned entry_off, const struct sfs_entry *entry)
+{
+    pthread_mutex_lock(&dcache_lock);
+
+    struct dentry *d = *dcache_off_slot(entry_off);
+    if (d) {
+        d->entry = *entry;
+    }
+    dcache_gen++;
+
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/* Copy the cached entry stored at disk offset `entry_off` into ret_entry.
+ * Returns 0 if it is cached, DCACHE_MISS otherwise. */
+static int dcache_lookup_off(unsigned entry_off, struct sfs_entry *ret_entry)
+{
+    int res = DCACHE_MISS;
+
+    pthread_mutex_lock(&dcache_lock);
+
+    struct dentry *d = *dcache_off_slot(entry_off);
+    if (d) {
+        *ret_entry = d->entry;
+        res = 0;
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+    return res;
+}
+
+
+/* Number of directory entries in one disk block. */
+#define DIR_ENTRIES_PER_BLK (SFS_BLOCK_SIZE / sizeof(struct sfs_entry))
+
+
+/*
+ * In-memory copy of a whole directory. dir_load() fetches the full root
+ * directory, or all blocks of a subdirectory, with one disk_read per extent of
+ * consecutive blocks (normally a single read), after which entries can be
+ * scanned without further I/O. blk_off[] holds the disk offset of each block
+ * of entries, so the disk offset of any entry can be computed for updates.
+ */
+struct sfs_dir {
+    blockidx_t dir;
+    unsigned nentries;
+    unsigned blk_off[SFS_ROOTDIR_NENTRIES / DIR_ENTRIES_PER_BLK];
+    struct sfs_entry entries[SFS_ROOTDIR_NENTRIES];
+};
+
+
+/* Load directory `dir` (DIR_ROOT or the first block of a subdirectory). */
+static void dir_load(blockidx_t dir, struct sfs_dir *d)
+{
+    d->dir = dir;
+
+    if (dir == DIR_ROOT) {
+        d->nentries = SFS_ROOTDIR_NENTRIES;
+        for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES / DIR_ENTRIES_PER_BLK; i++) {
+            d->blk_off[i] = SFS_ROOTDIR_OFF + i * SFS_BLOCK_SIZE;
+        }
+        disk_read(d->entries, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+        return;
+    }
+
+    unsigned maxBlks = SFS_DIR_NENTRIES / DIR_ENTRIES_PER_BLK;
+    unsigned nblks = 0;
+    blockidx_t blk = dir;
+
+    while (nblks < maxBlks && blk < SFS_BLOCKTBL_NENTRIES) {
+        blockidx_t next;
+        unsigned n = chain_extent(blk, maxBlks - nblks, &next);
+
+        disk_read(&d->entries[nblks * DIR_ENTRIES_PER_BLK], n * SFS_BLOCK_SIZE,
+                  SFS_DATA_OFF + blk * SFS_BLOCK_SIZE);
+        for (unsigned i = 0; i < n; i++) {
+            d->blk_off[nblks + i] = SFS_DATA_OFF + (blk + i) * SFS_BLOCK_SIZE;
+        }
+
+        nblks += n;
+        blk = next;
+    }
+
+    d->nentries = nblks * DIR_ENTRIES_PER_BLK;
+}
+
+
+static int dir_entry_used(const struct sfs_entry *entry)
+{
+    return entry->filename[0] != '\0';
+}
+
+
+/* Disk offset of entry `i` of a loaded directory. */
+static unsigned dir_entry_off(const struct sfs_dir *d, unsigned i)
+{
+    return d->blk_off[i / DIR_ENTRIES_PER_BLK]
+           + (i % DIR_ENTRIES_PER_BLK) * sizeof(struct sfs_entry);
+}
+
+
+/* Index of `name` in a loaded directory, or -1 if it is not there. */
+static int dir_find(const struct sfs_dir *d, const char *name)
+{
+    for (unsigned i = 0; i < d->nentries; i++) {
+        if (dir_entry_used(&d->entries[i])
+                && strncmp(d->entries[i].filename, name, SFS_FILENAME_MAX) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Index of the first unused slot in a loaded directory, or -1 if full. */
+static int dir_find_free(const struct sfs_dir *d)
+{
+    for (unsigned i = 0; i < d->nentries; i++) {
+        if (!dir_entry_used(&d->entries[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Overwrite entry `i` of a loaded directory, both in memory and on disk. */
+static void dir_set_entry(struct sfs_dir *d, unsigned i,
+                          const struct sfs_entry *entry)
+{
+    d->entries[i] = *entry;
+    disk_write_dirent(entry, sizeof(struct sfs_entry), dir_entry_off(d, i));
+}
+
+
+/*
+ * Search directory `dir` (DIR_ROOT or the first block of a subdirectory) on
+ * disk for `name`. Returns 0 and fills ret_entry and ret_entry_off if found,
+ * -ENOENT otherwise.
+ */
+static int dir_lookup(blockidx_t dir, const char *name,
+                      struct sfs_entry *ret_entry, unsigned *ret_entry_off)
+{
+    struct sfs_dir d;
+
+    dir_load(dir, &d);
+
+    int i = dir_find(&d, name);
+    if (i < 0) {
+        return -ENOENT;
+    }
+
+    *ret_entry = d.entries[i];
+    *ret_entry_off = dir_entry_off(&d, i);
+    return 0;
+}
+
+
+/*
+ * Usage of directory slots, for statfs. The root directory has a fixed number
+ * of slots and every subdirectory adds SFS_DIR_NENTRIES more, so counting the
+ * subdirectories and the used slots is enough. Both are counted once at mount
+ * by dir_usage_init and kept up to date by dir_add and dir_remove, so statfs
+ * never has to read a directory. They are updated under different directory
+ * locks, hence atomically.
+ */
+static unsigned dir_nsubdirs;
+static unsigned dir_nused;
+
+
+/* Count `entry` as added (n = 1) or removed (n = -1). */
+static void dir_usage_add(const struct sfs_entry *entry, int n)
+{
+    __atomic_add_fetch(&dir_nused, n, __ATOMIC_RELAXED);
+    if (entry->size & SFS_DIRECTORY) {
+        __atomic_add_fetch(&dir_nsubdirs, n, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Total and free number of directory slots. */
+static void dir_usage(unsigned *ret_total, unsigned *ret_free)
+{
+    unsigned used = __atomic_load_n(&dir_nused, __ATOMIC_RELAXED);
+    unsigned total = SFS_ROOTDIR_NENTRIES + SFS_DIR_NENTRIES
+                     * __atomic_load_n(&dir_nsubdirs, __ATOMIC_RELAXED);
+
+    *ret_total = total;
+    *ret_free = used < total ? total - used : 0;
+}
+
+
+/*
+ * Count the subdirectories and used slots of the whole tree, by loading every
+ * directory once. Called at mount, before any other thread runs. A
+ * subdirectory takes two blocks, which bounds the number of directories even
+ * in a damaged image whose tree has a cycle.
+ */
+static void dir_usage_init(void)
+{
+    blockidx_t *todo = malloc(SFS_BLOCKTBL_NENTRIES / 2 * sizeof(blockidx_t));
+    struct sfs_dir *d = malloc(sizeof(struct sfs_dir));
+    unsigned ntodo = 0;
+
+    dir_nsubdirs = 0;
+    dir_nused = 0;
+    if (!todo || !d) {
+        free(todo);
+        free(d);
+        return;
+    }
+
+    todo[ntodo++] = DIR_ROOT;
+    while (ntodo) {
+        dir_load(todo[--ntodo], d);
+
+        for (unsigned i = 0; i < d->nentries; i++) {
+            const struct sfs_entry *entry = &d->entries[i];
+
+            if (!dir_entry_used(entry)) {
+                continue;
+            }
+            if ((entry->size & SFS_DIRECTORY)
+                    && dir_nsubdirs >= SFS_BLOCKTBL_NENTRIES / 2) {
+                continue;
+            }
+            dir_usage_add(entry, 1);
+            if ((entry->size & SFS_DIRECTORY)
+                    && entry->first_block < SFS_BLOCKTBL_NENTRIES) {
+                todo[ntodo++] = entry->first_block;
+            }
+        }
+    }
+
+    free(todo);
+    free(d);
+}
+
+
+/*
+ * State of every directory slot, for the low-level interface, which names
+ * files by the inode number of their slot (see entry_ino). A slot's
+ * generation is bumped whenever a new entry is stored in it, so the kernel can
+ * tell a reused inode number from the file it knew before. Its directory
+ * (DIR_ROOT or the first block, or SFS_BLOCKIDX_END while the slot is free) is
+ * recorded by dir_add and by lookups, and lets an inode be resolved without
+ * knowing the path to it. Only allocated by slot_init, as the path-based
+ * interface does not need it; updated atomically, as each slot is updated
+ * under the lock of its own directory.
+ */
+struct slot_state {
+    unsigned gen;
+    blockidx_t dir;
+};
+
+/* Number of 64-byte slots from the root directory to the end of the image. */
+#define SLOT_COUNT \
+    ((SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE - SFS_ROOTDIR_OFF) \
+     / sizeof(struct sfs_entry))
+
+static struct slot_state *slot_states;
+
+
+static int slot_init(void)
+{
+    slot_states = malloc(SLOT_COUNT * sizeof(struct slot_state));
+    if (!slot_states) {
+        return -ENOMEM;
+    }
+
+    for (unsigned i = 0; i < SLOT_COUNT; i++) {
+        slot_states[i].gen = 0;
+        slot_states[i].dir = SFS_BLOCKIDX_END;
+    }
+    return 0;
+}
+
+
+static struct slot_state *slot_state(unsigned entry_off)
+{
+    return &slot_states[(entry_off - SFS_ROOTDIR_OFF)
+                        / sizeof(struct sfs_entry)];
+}
+
+
+/* Record that the slot at `entry_off` holds an entry of directory `dir`. */
+static void slot_set_dir(unsigned entry_off, blockidx_t dir)
+{
+    if (slot_states) {
+        __atomic_store_n(&slot_state(entry_off)->dir, dir, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Directory of the entry in the slot at `entry_off`, as recorded by
+ * slot_set_dir, or SFS_BLOCKIDX_END if unknown or free. */
+static blockidx_t slot_dir(unsigned entry_off)
+{
+    return __atomic_load_n(&slot_state(entry_off)->dir, __ATOMIC_RELAXED);
+}
+
+
+static unsigned slot_gen(unsigned entry_off)
+{
+    return __atomic_load_n(&slot_state(entry_off)->gen, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Add `entry` to directory `parent`. Fails with -EEXIST if the name is taken
+ * and -ENOSPC if the directory is full. The disk offset of the new entry is
+ * stored in ret_entry_off.
+ */
+static int dir_add(blockidx_t parent, const struct sfs_entry *entry,
+                   unsigned *ret_entry_off)
+{
+    struct sfs_dir d;
+
+    dir_load(parent, &d);
+
+    if (dir_find(&d, entry->filename) >= 0) {
+        return -EEXIST;
+    }
+
+    int i = dir_find_free(&d);
+    if (i < 0) {
+        return -ENOSPC;
+    }
+
+    dir_set_entry(&d, i, entry);
+    *ret_entry_off = dir_entry_off(&d, i);
+    dir_usage_add(entry, 1);
+
+    if (slot_states) {
+        __atomic_add_fetch(&slot_state(*ret_entry_off)->gen, 1,
+                           __ATOMIC_RELAXED);
+    }
+    slot_set_dir(*ret_entry_off, parent);
+
+    dcache_insert(parent, entry->filename, entry, *ret_entry_off);
+    return 0;
+}
+
+
+/* Clear the entry at disk offset `entry_off`, which is `name` in `parent`.
+ * `entry` is the entry being removed. */
+static void dir_remove(blockidx_t parent, const char *name,
+                       const struct sfs_entry *entry, unsigned entry_off)
+{
+    struct sfs_entry empty;
+
+    memset(&empty, 0, sizeof(struct sfs_entry));
+    empty.first_block = SFS_BLOCKIDX_EMPTY;
+
+    disk_write_dirent(&empty, sizeof(struct sfs_entry), entry_off);
+    dcache_insert(parent, name, NULL, 0);
+    dir_usage_add(entry, -1);
+    slot_set_dir(entry_off, SFS_BLOCKIDX_END);
+}
+
+
+/* Rename the entry at disk offset `entry_off`, `name` in `parent`, in place
+ * to `entry`, which holds the new name. */
+static void dir_rename(blockidx_t parent, const char *name,
+                       const struct sfs_entry *entry, unsigned entry_off)
+{
+    disk_write_dirent(entry, sizeof(struct sfs_entry), entry_off);
+    dcache_insert(parent, name, NULL, 0);
+    dcache_insert(parent, entry->filename, entry, entry_off);
+}
+
+
+/* Whether directory `dir` has no entries. */
+static int dir_is_empty(blockidx_t dir)
+{
+    struct sfs_dir d;
+
+    dir_load(dir, &d);
+
+    for (unsigned i = 0; i < d.nentries; i++) {
+        if (dir_entry_used(&d.entries[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Whether directory `sub` is `dir` itself or lies anywhere below it, found by
+ * loading every directory of the tree below `dir` (bounded as in
+ * dir_usage_init). Returns 1 if so, 0 if not, < 0 on error.
+ */
+static int dir_is_below(blockidx_t sub, blockidx_t dir)
+{
+    if (sub == dir) {
+        return 1;
+    }
+    if (sub == DIR_ROOT) {
+        return 0;
+    }
+
+    blockidx_t *todo = malloc(SFS_BLOCKTBL_NENTRIES / 2 * sizeof(blockidx_t));
+    struct sfs_dir *d = malloc(sizeof(struct sfs_dir));
+    unsigned ntodo = 0, nseen = 0;
+    int res = 0;
+
+    if (!todo || !d) {
+        free(todo);
+        free(d);
+        return -ENOMEM;
+    }
+
+    todo[ntodo++] = dir;
+    while (ntodo && !res) {
+        dir_load(todo[--ntodo], d);
+
+        for (unsigned i = 0; i < d->nentries; i++) {
+            const struct sfs_entry *entry = &d->entries[i];
+
+            if (!dir_entry_used(entry) || !(entry->size & SFS_DIRECTORY)
+                    || entry->first_block >= SFS_BLOCKTBL_NENTRIES
+                    || nseen >= SFS_BLOCKTBL_NENTRIES / 2) {
+                continue;
+            }
+            if (entry->first_block == sub) {
+                res = 1;
+                break;
+            }
+            nseen++;
+            todo[ntodo++] = entry->first_block;
+        }
+    }
+
+    free(todo);
+    free(d);
+    return res;
+}
+
+
+/*
+ * Locking. Every directory has a reader/writer lock (lock striping over
+ * DIR_LOCKS locks, keyed by the directory's first block), held for reading
+ * while its entries are read from disk and for writing while entries are
+ * added or removed. Operations never hold more than one directory lock.
+ *
+ * A directory can only disappear or move through rmdir and rename, so those
+ * hold ns_lock for writing while every other namespace operation holds it for
+ * reading. This guarantees that a directory found during a path walk still
+ * exists when its lock is taken. Holding ns_lock for writing excludes every
+ * other change to directories, so no directory lock is needed then.
+ *
+ * Lock order: ns_lock, directory lock, node lock, and finally the leaf locks
+ * (alloc_lock, dcache_lock, nodes_lock and the handle locks).
+ */
+#define DIR_LOCKS   64u
+
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t dir_locks[DIR_LOCKS] = {
+    [0 ... DIR_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+
+static pthread_rwlock_t *dir_lock(blockidx_t dir)
+{
+    return &dir_locks[dir % DIR_LOCKS];
+}
+
+
+/* Look up `name` in directory `dir`, through the dentry cache. The caller must
+ * hold the directory's lock. */
+static int dir_get(blockidx_t dir, const char *name,
+                   struct sfs_entry *ret_entry, unsigned *ret_entry_off)
+{
+    if (strlen(name) > SFS_FILENAME_MAX - 1) {
+        return -ENAMETOOLONG;
+    }
+
+    int res = dcache_lookup(dir, name, ret_entry, ret_entry_off);
+
+    if (res != DCACHE_MISS) {
+        return res;
+    }
+
+    unsigned gen = dcache_snapshot();
+
+    if (dir_lookup(dir, name, ret_entry, ret_entry_off) != 0) {
+        dcache_fill(dir, name, NULL, 0, gen);
+        return -ENOENT;
+    }
+
+    dcache_fill(dir, name, ret_entry, *ret_entry_off, gen);
+    return 0;
+}
+
+
+/*
+ * This is a helper function that is optional, but highly recomended you
+ * implement and use. Given a path, it looks it up on disk. It will return 0 on
+ * success, and a non-zero value on error (e.g., the file did not exist).
+ * The resulting directory entry is placed in the memory pointed to by
+ * ret_entry. Additionally it can return the offset of that direntry on disk in
+ * ret_entry_off, which you can use to update the entry and write it back to
+ * disk (e.g., rmdir, unlink, truncate, write).
+ *
+ * You can start with implementing this function to work just for paths in the
+ * root entry, and later modify it to also work for paths with subdirectories.
+ * This way, all of your other functions can use this helper and will
+ * automatically support subdirectories. To make this function support
+ * subdirectories, we recommend you refactor this function to be recursive, and
+ * take the current directory as argument as well. For example:
+ *
+ *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
+ *                           size_t parent_nentries, blockidx_t parent_blockidx,
+ *                           struct sfs_entry *ret_entry,
+ *                           unsigned *ret_entry_off)
+ *
+ * Here parent is the directory it is currently searching (at first the rootdir,
+ * later the subdir). The parent_nentries tells the function how many entries
+ * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
+ * Finally, the parent_blockidx contains the blockidx of the given directory on
+ * the disk, which will help in calculating ret_entry_off.
+ *
+ * Lookups are served from the dentry cache where possible. The caller must
+ * hold ns_lock.
+ */
+static int lookup_path(const char *path, size_t pathLen,
+                       struct sfs_entry *ret_entry, unsigned *ret_entry_off)
+{
+    const char *end = path + pathLen;
+    blockidx_t dir = DIR_ROOT;
+    char name[SFS_FILENAME_MAX];
+    struct sfs_entry entry;
+    unsigned entryOff = 0;
+    int haveEntry = 0;
+
+    while (path < end) {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+
+        const char *sep = memchr(path, '/', end - path);
+        size_t len = (sep ? sep : end) - path;
+
+        if (len >= SFS_FILENAME_MAX) {
+            return -ENAMETOOLONG;
+        }
+        if (haveEntry) {
+            if (!(entry.size & SFS_DIRECTORY)) {
+                return -ENOTDIR;
+            }
+            dir = entry.first_block;
+        }
+
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        int res = dcache_lookup(dir, name, &entry, &entryOff);
+
+        if (res == DCACHE_MISS) {
+            pthread_rwlock_rdlock(dir_lock(dir));
+            res = dir_get(dir, name, &entry, &entryOff);
+            pthread_rwlock_unlock(dir_lock(dir));
+        }
+        if (res != 0) {
+            return res;
+        }
+        haveEntry = 1;
+    }
+
+    if (haveEntry && ret_entry) {
+        *ret_entry = entry;
+    }
+    if (haveEntry && ret_entry_off) {
+        *ret_entry_off = entryOff;
+    }
+
+    return 0;
+}
+
+
+static int get_entry(const char *path, struct sfs_entry *ret_entry,
+                     unsigned *ret_entry_off)
+{
+    return lookup_path(path, strlen(path), ret_entry, ret_entry_off);
+}
+
+
+/*
+ * Resolve the directory containing `path`. Its first block (or DIR_ROOT) is
+ * stored in ret_dir, and a pointer to the last component of `path` in
+ * ret_name. Returns 0 on success, < 0 on error.
+ */
+static int get_parent(const char *path, blockidx_t *ret_dir,
+                      const char **ret_name)
+{
+    const char *slash = strrchr(path, '/');
+    struct sfs_entry entry;
+
+    if (!slash) {
+        return -ENOENT;
+    }
+    *ret_name = slash + 1;
+
+    if (strspn(path, "/") == (size_t)(slash - path + 1)) {
+        *ret_dir = DIR_ROOT;
+        return 0;
+    }
+
+    int res = lookup_path(path, slash - path, &entry, NULL);
+    if (res != 0) {
+        return res;
+    }
+    if (!(entry.size & SFS_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+
+    *ret_dir = entry.first_block;
+    return 0;
+}
+
+/*
+ * Open files. Every file that is open has exactly one sfs_node, identified by
+ * the disk offset of its directory entry and shared by all handles to it. The
+ * node holds a copy of the entry, so I/O through a handle never has to resolve
+ * the path again. Each handle (stored in fi->fh) has its own chain cursor.
+ *
+ * Operations that cut a file's chain behind the back of its handles (i.e.,
+ * truncate) bump the node's generation while holding its lock for writing.
+ * This makes all cursors fall back to the start of the chain on their next
+ * use. Writes only ever append to the chain, which leaves every cursor valid.
+ *
+ * The node also caches the last block of the chain and its length, found with
+ * one walk on first use and kept current as the chain changes, so appending
+ * to a file costs the same however long it already is.
+ *
+ * Unlinking an open file takes its node out of the table (see node_unlink):
+ * the handles keep reading and writing its chain, which no entry on disk
+ * refers to anymore, and the chain is freed when the last of them is closed.
+ *
+ * The node's lock is held for reading during data I/O and for writing while
+ * its chain or entry changes. nodes_lock protects the table of open nodes and
+ * their reference counts, and each handle's lock protects its cursor.
+ */
+struct sfs_node {
+    unsigned entry_off;
+    struct sfs_entry entry;
+    unsigned refcnt;
+    unsigned gen;
+    int tail_valid;
+    blockidx_t tail;
+    unsigned nblocks;
+    int unlinked;
+    pthread_rwlock_t lock;
+    struct sfs_node *next;
+};
+
+struct sfs_handle {
+    struct sfs_node *node;
+    uint64_t id;
+    int accmode;
+    pthread_mutex_t lock;
+    unsigned gen;
+    struct chain_pos pos;
+    off_t ra_next;
+    off_t ra_end;
+    size_t ra_window;
+};
+
+#define NODE_HASH_SIZE  64u
+
+static struct sfs_node *open_nodes[NODE_HASH_SIZE];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Last id given to an open file. Unlike the address of a handle, an id is
+ * never reused, so it identifies the open file in a capture. */
+static uint64_t open_last_id;
+
+
+static uint64_t open_new_id(void)
+{
+    return __atomic_add_fetch(&open_last_id, 1, __ATOMIC_RELAXED);
+}
+
+
+static struct sfs_node **node_slot(unsigned entry_off)
+{
+    struct sfs_node **np = &open_nodes[(entry_off / sizeof(struct sfs_entry))
+                                       % NODE_HASH_SIZE];
+
+    while (*np && (*np)->entry_off != entry_off) {
+        np = &(*np)->next;
+    }
+    return np;
+}
+
+
+/* Take a reference to the node for the entry at `entry_off`. If the file was
+ * not open yet, the node is created from `entry`, or NULL is returned if
+ * `entry` is NULL. */
+static struct sfs_node *node_get(unsigned entry_off,
+                                 const struct sfs_entry *entry)
+{
+    pthread_mutex_lock(&nodes_lock);
+
+    struct sfs_node **np = node_slot(entry_off);
+    struct sfs_node *node = *np;
+
+    if (!node && entry) {
+        node = calloc(1, sizeof(struct sfs_node));
+        if (node) {
+            node->entry_off = entry_off;
+            node->entry = *entry;
+            pthread_rwlock_init(&node->lock, NULL);
+            *np = node;
+        }
+    }
+
+    if (node) {
+        node->refcnt++;
+    }
+
+    pthread_mutex_unlock(&nodes_lock);
+    return node;
+}
+
+
+/* Take another reference to `node`, which the caller already holds one to. */
+static struct sfs_node *node_ref(struct sfs_node *node)
+{
+    pthread_mutex_lock(&nodes_lock);
+    node->refcnt++;
+    pthread_mutex_unlock(&nodes_lock);
+    return node;
+}
+
+
+static void node_put(struct sfs_node *node)
+{
+    pthread_mutex_lock(&nodes_lock);
+
+    if (--node->refcnt) {
+        pthread_mutex_unlock(&nodes_lock);
+        return;
+    }
+
+    if (!node->unlinked) {
+        struct sfs_node **np = node_slot(node->entry_off);
+        *np = node->next;
+    }
+
+    pthread_mutex_unlock(&nodes_lock);
+
+    /* Nothing else can reach the chain of an unlinked file. */
+    if (node->unlinked) {
+        free_chain(node->entry.first_block);
+    }
+
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+}
+
+
+/* The entry of `node` was removed from its directory: drop the node from the
+ * table, so the slot can be reused by a new file, and stop its writes from
+ * touching the slot. The caller must hold the node's lock for writing. */
+static void node_unlink(struct sfs_node *node)
+{
+    pthread_mutex_lock(&nodes_lock);
+
+    struct sfs_node **np = node_slot(node->entry_off);
+    *np = node->next;
+    node->unlinked = 1;
+
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+
+/* The entry of `node` moved to the slot at `entry_off`. The caller must hold
+ * the node's lock for writing. */
+static void node_move(struct sfs_node *node, unsigned entry_off)
+{
+    pthread_mutex_lock(&nodes_lock);
+
+    struct sfs_node **np = node_slot(node->entry_off);
+    *np = node->next;
+
+    node->entry_off = entry_off;
+    np = node_slot(entry_off);
+    node->next = *np;
+    *np = node;
+
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+
+/* About to change the entry at `entry_off` and/or its chain. If the file is
+ * open, its node is returned locked for writing, else NULL. */
+static struct sfs_node *node_begin_update(unsigned entry_off)
+{
+    struct sfs_node *node = node_get(entry_off, NULL);
+
+    if (node) {
+        pthread_rwlock_wrlock(&node->lock);
+    }
+    return node;
+}
+
+
+/* Finish an update started with node_begin_update. */
+static void node_end_update(struct sfs_node *node)
+{
+    if (!node) {
+        return;
+    }
+
+    pthread_rwlock_unlock(&node->lock);
+    node_put(node);
+}
+
+
+/* Number of blocks in the node's chain, with its last block (or
+ * SFS_BLOCKIDX_END for an empty chain) stored in ret_tail. The caller must hold
+ * the node's lock for writing. */
+static unsigned node_tail(struct sfs_node *node, blockidx_t *ret_tail)
+{
+    if (!node->tail_valid) {
+        node->tail = SFS_BLOCKIDX_END;
+        node->nblocks = 0;
+
+        for (blockidx_t blk = node->entry.first_block;
+             blk < SFS_BLOCKTBL_NENTRIES; blk = get_next(blk)) {
+            node->tail = blk;
+            node->nblocks++;
+        }
+        node->tail_valid = 1;
+    }
+
+    *ret_tail = node->tail;
+    return node->nblocks;
+}
+
+
+static int handle_open(unsigned entry_off, const struct sfs_entry *entry,
+                       struct fuse_file_info *fi)
+{
+    struct sfs_handle *h = calloc(1, sizeof(struct sfs_handle));
+
+    if (!h) {
+        return -ENOMEM;
+    }
+
+    h->node = node_get(entry_off, entry);
+    if (!h->node) {
+        free(h);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    h->id = open_new_id();
+    /* fi->flags is only set for open and create, not for later calls. */
+    h->accmode = fi->flags & O_ACCMODE;
+    h->gen = h->node->gen;
+    h->pos.blk = SFS_BLOCKIDX_END;
+
+    fi->fh = (uintptr_t)h;
+    /* The kernel may keep the pages it cached for earlier opens, as all
+     * writes pass through it. The in-driver copy does not, so its destination
+     * is refreshed after the copy instead (see SFS_IOC_COPY_RANGE in sfs.h). */
+    fi->keep_cache = options.kernel_cache;
+    return 0;
+}
+
+
+static void handle_close(struct sfs_handle *h)
+{
+    node_put(h->node);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+
+/* Copy the handle's cursor into `pos`, resetting it first if the node's chain
+ * changed since it was last used. The caller must hold the node's lock. */
+static void handle_load_pos(struct sfs_handle *h, struct chain_pos *pos)
+{
+    pthread_mutex_lock(&h->lock);
+
+    if (h->gen != h->node->gen) {
+        h->gen = h->node->gen;
+        h->pos.blk = SFS_BLOCKIDX_END;
+    }
+    *pos = h->pos;
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+
+static void handle_save_pos(struct sfs_handle *h, const struct chain_pos *pos)
+{
+    pthread_mutex_lock(&h->lock);
+    h->pos = *pos;
+    pthread_mutex_unlock(&h->lock);
+}
+
+
+/*
+ * Readahead. Every handle remembers where its previous read ended. A read that
+ * starts there is sequential, and for sequential readers a window of data past
+ * the read is queued for ra_thread, which loads it into the block cache (see
+ * disk_prefetch) while the reader carries on. As in Linux, the window starts
+ * at RA_MIN and doubles up to RA_MAX each time the reader has consumed half of
+ * what was requested, so the next window is fetched before it is needed. Any
+ * other read resets the window.
+ *
+ * Queued requests hold a reference to their node. Readahead is advisory:
+ * requests that do not fit in the queue are dropped.
+ */
+#define RA_MIN      (64u * 1024)
+#define RA_MAX      (1024u * 1024)
+#define RA_QUEUE    64u
+
+struct ra_req {
+    struct sfs_node *node;
+    struct chain_pos pos;
+    unsigned gen;
+    off_t offset;
+    size_t size;
+};
+
+static struct ra_req ra_queue[RA_QUEUE];
+static unsigned ra_head, ra_count;
+static int ra_running, ra_stop;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* Load the data blocks covering `r` into the cache. */
+static void ra_fetch(struct ra_req *r)
+{
+    struct sfs_node *node = r->node;
+
+    pthread_rwlock_rdlock(&node->lock);
+
+    size_t fsize = node->entry.size & SFS_SIZEMASK;
+    unsigned idx = r->offset / SFS_BLOCK_SIZE;
+    unsigned endIdx = ((size_t)r->offset + r->size < fsize
+                       ? (size_t)r->offset + r->size : fsize)
+                      + SFS_BLOCK_SIZE - 1;
+    endIdx /= SFS_BLOCK_SIZE;
+
+    if (node->gen != r->gen) {
+        r->pos.blk = SFS_BLOCKIDX_END;
+    }
+
+    blockidx_t blk = chain_seek(node->entry.first_block, idx, &r->pos);
+
+    while (idx < endIdx && blk < SFS_BLOCKTBL_NENTRIES) {
+        blockidx_t next;
+        unsigned n = chain_extent(blk, endIdx - idx, &next);
+
+        disk_prefetch(SFS_DATA_OFF + blk * SFS_BLOCK_SIZE,
+                      n * SFS_BLOCK_SIZE);
+        idx += n;
+        blk = next;
+    }
+
+    pthread_rwlock_unlock(&node->lock);
+}
+
+
+static void *ra_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&ra_lock);
+
+    while (!ra_stop) {
+        if (ra_count == 0) {
+            pthread_cond_wait(&ra_cond, &ra_lock);
+            continue;
+        }
+
+        struct ra_req r = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % RA_QUEUE;
+        ra_count--;
+
+        pthread_mutex_unlock(&ra_lock);
+        ra_fetch(&r);
+        node_put(r.node);
+        pthread_mutex_lock(&ra_lock);
+    }
+
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+
+/* Queue a prefetch of `size` bytes at `offset` of the file of `node`, starting
+ * the chain walk from cursor `pos` (valid for node generation `gen`). */
+static void ra_submit(struct sfs_node *node, const struct chain_pos *pos,
+                      unsigned gen, off_t offset, size_t size)
+{
+    struct sfs_node *ref = node_ref(node);
+    int queued = 0;
+
+    pthread_mutex_lock(&ra_lock);
+
+    /* Started on first use, after fuse has daemonized. */
+    if (!ra_running && !ra_stop
+            && pthread_create(&ra_thread, NULL, ra_main, NULL) == 0) {
+        ra_running = 1;
+    }
+
+    if (ra_running && ra_count < RA_QUEUE) {
+        struct ra_req *r = &ra_queue[(ra_head + ra_count) % RA_QUEUE];
+
+        r->node = ref;
+        r->pos = *pos;
+        r->gen = gen;
+        r->offset = offset;
+        r->size = size;
+        ra_count++;
+        queued = 1;
+        pthread_cond_signal(&ra_cond);
+    }
+
+    pthread_mutex_unlock(&ra_lock);
+
+    if (!queued) {
+        node_put(ref);
+    }
+}
+
+
+/* Stop ra_thread and drop whatever is still queued. */
+static void ra_shutdown(void)
+{
+    pthread_mutex_lock(&ra_lock);
+    ra_stop = 1;
+    pthread_cond_signal(&ra_cond);
+    int running = ra_running;
+    pthread_mutex_unlock(&ra_lock);
+
+    if (running) {
+        pthread_join(ra_thread, NULL);
+    }
+
+    for (; ra_count; ra_count--) {
+        node_put(ra_queue[ra_head].node);
+        ra_head = (ra_head + 1) % RA_QUEUE;
+    }
+}
+
+
+/* Account for a read of `size` bytes at `offset` through handle `h`, whose
+ * cursor `pos` was left at the last block read, and queue readahead if it is
+ * sequential. The caller must hold the node's lock. */
+static void readahead(struct sfs_handle *h, const struct chain_pos *pos,
+                      off_t offset, size_t size)
+{
+    off_t end = offset + size;
+    off_t from = 0;
+    size_t len = 0;
+
+    pthread_mutex_lock(&h->lock);
+
+    if (offset != h->ra_next || size == 0) {
+        h->ra_window = 0;
+        h->ra_end = end;
+    } else if (h->ra_window == 0) {
+        h->ra_window = RA_MIN;
+        from = end;
+        len = h->ra_window;
+        h->ra_end = from + len;
+    } else if (h->ra_end - end <= (off_t)h->ra_window / 2) {
+        if (h->ra_window < RA_MAX) {
+            h->ra_window *= 2;
+        }
+        from = h->ra_end > end ? h->ra_end : end;
+        len = h->ra_window;
+        h->ra_end = from + len;
+    }
+    h->ra_next = end;
+
+    pthread_mutex_unlock(&h->lock);
+
+    if (len && (size_t)from < (h->node->entry.size & SFS_SIZEMASK)) {
+        ra_submit(h->node, pos, h->node->gen, from, len);
+    }
+}
+
+
+/* Store the changed `entry` of the file of `node`, on disk too unless it was
+ * unlinked. The caller must hold the node's lock for writing. */
+static void node_set_entry(struct sfs_node *node, const struct sfs_entry *entry)
+{
+    if (!node->unlinked) {
+        disk_write_dirent(entry, sizeof(struct sfs_entry), node->entry_off);
+        dcache_update(node->entry_off, entry);
+    }
+    node->entry = *entry;
+}
+
+
+/* A bufvec with room for `count` buffers, or NULL if out of memory. Free it
+ * with bufvec_free. */
+static struct fuse_bufvec *bufvec_alloc(size_t count)
+{
+    struct fuse_bufvec *bv = calloc(1, sizeof(struct fuse_bufvec)
+                                       + (count - 1) * sizeof(struct fuse_buf));
+
+    if (bv) {
+        bv->count = count;
+    }
+    return bv;
+}
+
+
+/* Free a bufvec and the memory of its buffers. */
+static void bufvec_free(struct fuse_bufvec *bv)
+{
+    for (size_t i = 0; i < bv->count; i++) {
+        free(bv->buf[i].mem);
+    }
+    free(bv);
+}
+
+
+/* A bufvec describing the `n` extents in `ext` of the image fd `fd`. */
+static struct fuse_bufvec *bufvec_extents(int fd, const struct chain_ext *ext,
+                                          unsigned n)
+{
+    struct fuse_bufvec *bv = bufvec_alloc(n);
+
+    for (unsigned i = 0; bv && i < n; i++) {
+        bv->buf[i].size = ext[i].size;
+        bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[i].fd = fd;
+        bv->buf[i].pos = ext[i].offset;
+    }
+    return bv;
+}
+
+
+/*
+ * Write `size` bytes from `src` at `offset` into the chain starting at
+ * `first`, with a cursor `pos` as for chain_io. Data in memory is written with
+ * chain_io. Data that fuse left in a pipe (see conn_init) is spliced straight
+ * into the image, one segment per extent, where the image can be accessed
+ * directly (see disk_fd), and is copied into memory first otherwise.
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static ssize_t chain_write_buf(blockidx_t first, struct fuse_bufvec *src,
+                               size_t size, off_t offset,
+                               struct chain_pos *pos)
+{
+    const struct fuse_buf *b = &src->buf[src->idx];
+    struct chain_ext ext[IO_BATCH];
+    ssize_t res;
+
+    if (src->idx + 1 == src->count && !(b->flags & FUSE_BUF_IS_FD)) {
+        return chain_io(first, (char *)b->mem + src->off, size, offset, 1,
+                        pos);
+    }
+
+    int fd = disk_fd();
+    size_t mapped;
+    unsigned n = fd >= 0 ? chain_map(first, size, offset, pos, ext, IO_BATCH,
+                                     &mapped)
+                         : 0;
+
+    if (n && mapped == size) {
+        struct fuse_bufvec *dst = bufvec_extents(fd, ext, n);
+
+        if (!dst) {
+            return -ENOMEM;
+        }
+        res = fuse_buf_copy(dst, src, 0);
+        for (unsigned i = 0; i < n; i++) {
+            disk_invalidate(ext[i].offset, ext[i].size);
+        }
+        bufvec_free(dst);
+        return res;
+    }
+
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+
+    mem.buf[0].mem = malloc(size);
+    if (!mem.buf[0].mem) {
+        return -ENOMEM;
+    }
+    res = fuse_buf_copy(&mem, src, 0);
+    if (res > 0) {
+        res = chain_io(first, mem.buf[0].mem, res, offset, 1, pos);
+    }
+    free(mem.buf[0].mem);
+    return res;
+}
+
+
+/*
+ * Write the data in `src` at `offset` into the file of `node`. The chain is
+ * grown by as many blocks as the write needs in one go (see chain_extend), any
+ * gap between the old end of the file and `offset` is filled with zeroes, and
+ * the data is written straight from `src` (see chain_write_buf). The entry is
+ * updated at most once, after the data is in place. `pos` is the cursor as
+ * for chain_io. The caller must hold the node's lock for writing.
+ * Returns the number of bytes written, which is less than the size of `src`
+ * only if the disk is full, or < 0 on error.
+ */
+static int write_node(struct sfs_node *node, struct fuse_bufvec *src,
+                      off_t offset, struct chain_pos *pos)
+{
+    struct sfs_entry entry = node->entry;
+    size_t fsize = entry.size & SFS_SIZEMASK;
+    size_t size = fuse_buf_size(src);
+
+    if (size == 0) {
+        return 0;
+    }
+    if (offset < 0 || (size_t)offset + size > SFS_SIZEMASK) {
+        return -EFBIG;
+    }
+
+    blockidx_t first = entry.first_block;
+    blockidx_t tail;
+    unsigned nblocks = node_tail(node, &tail);
+    blockidx_t oldTail = tail;
+
+    unsigned need = ((size_t)offset + size + SFS_BLOCK_SIZE - 1)
+                    / SFS_BLOCK_SIZE;
+
+    if (need > nblocks) {
+        nblocks += chain_extend(&first, &tail, need - nblocks);
+
+        size_t room = (size_t)nblocks * SFS_BLOCK_SIZE;
+        if (room <= (size_t)offset) {
+            chain_cut(&first, oldTail);
+            return -ENOSPC;
+        }
+
+        if (size > room - offset) {
+            size = room - offset;
+        }
+    }
+
+    if ((size_t)offset > fsize) {
+        chain_io(first, NULL, offset - fsize, fsize, 1, NULL);
+    }
+
+    ssize_t res = chain_write_buf(first, src, size, offset, pos);
+    if (res != (ssize_t)size) {
+        /* Only possible if fuse fails to deliver the data. */
+        chain_cut(&first, oldTail);
+        node->gen++;
+        return res < 0 ? res : -EIO;
+    }
+
+    node->tail = tail;
+    node->nblocks = nblocks;
+
+    if ((size_t)offset + size > fsize) {
+        entry.first_block = first;
+        entry.size = (entry.size & ~SFS_SIZEMASK) | (offset + size);
+        node_set_entry(node, &entry);
+    }
+
+    return size;
+}
+
+
+/*
+ * Set the size of the file of `node` to `size` bytes. Shrinking cuts the chain
+ * after the new last block and frees the rest in batches (see chain_cut), once
+ * the new size is on disk. Growing appends the missing blocks with
+ * chain_extend and zero-fills everything past the old end of the file with
+ * large writes from the shared zero buffer (see chain_io), before the new size
+ * is stored. The caller must hold the node's lock for writing.
+ * Returns 0 on success, < 0 on error.
+ */
+static int truncate_node(struct sfs_node *node, off_t size)
+{
+    struct sfs_entry entry = node->entry;
+    size_t fsize = entry.size & SFS_SIZEMASK;
+    blockidx_t first = entry.first_block;
+    blockidx_t tail;
+    unsigned nblocks = node_tail(node, &tail);
+
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if ((size_t)size > SFS_SIZEMASK) {
+        return -EFBIG;
+    }
+    if ((size_t)size == fsize) {
+        return 0;
+    }
+
+    unsigned need = ((size_t)size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+
+    if (need > nblocks) {
+        blockidx_t oldTail = tail;
+
+        if (chain_extend(&first, &tail, need - nblocks) < need - nblocks) {
+            chain_cut(&first, oldTail);
+            return -ENOSPC;
+        }
+    }
+
+    if ((size_t)size > fsize) {
+        chain_io(first, NULL, size - fsize, fsize, 1, NULL);
+    }
+
+    blockidx_t newTail = tail;
+    if (need < nblocks) {
+        newTail = need ? chain_seek(first, need - 1, NULL) : SFS_BLOCKIDX_END;
+    }
+
+    entry.first_block = need ? first : SFS_BLOCKIDX_END;
+    entry.size = (entry.size & ~SFS_SIZEMASK) | size;
+    node_set_entry(node, &entry);
+
+    if (need < nblocks) {
+        chain_cut(&first, newTail);
+        /* Cursors may point into the freed blocks. */
+        node->gen++;
+    }
+
+    node->tail = newTail;
+    node->nblocks = need;
+    return 0;
+}
+
+
+/*
+ * Copy `size` bytes at `srcOff` of the file of `src` to `dstOff` in the file
+ * of `dst`, image to image (see disk_copy), so the data never passes through
+ * this process. The chain of `dst` is first grown by all the blocks the copy
+ * needs at once, which the allocator hands out as a single run where it can
+ * (see chain_extend), and any gap before `dstOff` is filled with zeroes. Both
+ * ranges are then resolved into extents up to IO_BATCH at a time, and copied
+ * one overlapping piece of a source and a destination extent at a time. The
+ * entry is updated at most once, after the data is in place. The caller must
+ * hold the lock of `dst` for writing and that of `src` for reading, which may
+ * be the same node, but then the ranges must not overlap.
+ * Returns the number of bytes copied, which is less than `size` only at the
+ * end of the source or if the disk is full, or < 0 on error.
+ */
+static ssize_t copy_node(struct sfs_node *dst, off_t dstOff,
+                         struct sfs_node *src, off_t srcOff, size_t size)
+{
+    size_t srcSize = src->entry.size & SFS_SIZEMASK;
+
+    if (srcOff < 0 || dstOff < 0) {
+        return -EINVAL;
+    }
+    if ((size_t)srcOff >= srcSize) {
+        return 0;
+    }
+    if (size > srcSize - srcOff) {
+        size = srcSize - srcOff;
+    }
+    if ((size_t)dstOff + size > SFS_SIZEMASK) {
+        return -EFBIG;
+    }
+    if (dst == src && srcOff < dstOff + (off_t)size
+            && dstOff < srcOff + (off_t)size) {
+        return -EINVAL;
+    }
+
+    struct sfs_entry entry = dst->entry;
+    size_t fsize = entry.size & SFS_SIZEMASK;
+    blockidx_t first = entry.first_block;
+    blockidx_t tail;
+    unsigned nblocks = node_tail(dst, &tail);
+    blockidx_t oldTail = tail;
+
+    unsigned need = ((size_t)dstOff + size + SFS_BLOCK_SIZE - 1)
+                    / SFS_BLOCK_SIZE;
+
+    if (need > nblocks) {
+        nblocks += chain_extend(&first, &tail, need - nblocks);
+
+        size_t room = (size_t)nblocks * SFS_BLOCK_SIZE;
+        if (room <= (size_t)dstOff) {
+            chain_cut(&first, oldTail);
+            return -ENOSPC;
+        }
+
+        if (size > room - dstOff) {
+            size = room - dstOff;
+        }
+    }
+
+    if ((size_t)dstOff > fsize) {
+        chain_io(first, NULL, dstOff - fsize, fsize, 1, NULL);
+    }
+
+    struct chain_ext srcExt[IO_BATCH], dstExt[IO_BATCH];
+    struct chain_pos srcPos = { SFS_BLOCKIDX_END, 0 };
+    struct chain_pos dstPos = { SFS_BLOCKIDX_END, 0 };
+    size_t done = 0;
+
+    while (done < size) {
+        size_t srcMapped, dstMapped;
+        unsigned nSrc = chain_map(src == dst ? first : src->entry.first_block,
+                                  size - done, srcOff + done, &srcPos, srcExt,
+                                  IO_BATCH, &srcMapped);
+        unsigned nDst = nSrc ? chain_map(first, srcMapped, dstOff + done,
+                                         &dstPos, dstExt, IO_BATCH,
+                                         &dstMapped)
+                             : 0;
+
+        if (nDst == 0) {
+            break;
+        }
+
+        size_t s = 0, d = 0, sPart = 0, dPart = 0;
+
+        for (size_t copied = 0; copied < dstMapped; ) {
+            size_t len = srcExt[s].size - sPart;
+
+            if (len > dstExt[d].size - dPart) {
+                len = dstExt[d].size - dPart;
+            }
+            disk_copy(dstExt[d].offset + dPart, srcExt[s].offset + sPart, len);
+
+            copied += len;
+            if ((sPart += len) == srcExt[s].size) {
+                s++;
+                sPart = 0;
+            }
+            if ((dPart += len) == dstExt[d].size) {
+                d++;
+                dPart = 0;
+            }
+        }
+        done += dstMapped;
+    }
+
+    /* Only if the source chain is shorter than its size: give back the
+     * blocks that were not filled. */
+    size_t end = (size_t)dstOff + done > fsize ? (size_t)dstOff + done : fsize;
+    unsigned used = (end + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+
+    if (used < nblocks) {
+        tail = used ? chain_seek(first, used - 1, NULL) : SFS_BLOCKIDX_END;
+        chain_cut(&first, tail);
+        nblocks = used;
+        dst->gen++;
+    }
+
+    dst->tail = tail;
+    dst->nblocks = nblocks;
+
+    if ((size_t)dstOff + done > fsize) {
+        entry.first_block = first;
+        entry.size = (entry.size & ~SFS_SIZEMASK) | (dstOff + done);
+        node_set_entry(dst, &entry);
+    }
+
+    return done;
+}
+
+
+/*
+ * Statistics. Every callback is timed and counted per operation (see the
+ * timed_* wrappers around the operation tables), in per-thread counters that
+ * are only added up when the statistics are read (see stats_set in diskio.h).
+ * Together with the I/O counters of diskio they can be read as JSON at any
+ * time from the virtual file /.sfs_stats, and are dumped on SIGUSR1: to the
+ * file given with --stats=FILE, which is replaced atomically and whose "seq"
+ * counts the dumps so a reader can tell when a new one has arrived, or to
+ * stderr otherwise.
+ *
+ * SIGUSR1 is blocked in every thread (see main) and picked up by stats_main
+ * with sigwait, so the dump runs as normal code rather than in a signal
+ * handler. The thread is started by init, after fuse has daemonized.
+ */
+enum sfs_op {
+    OP_LOOKUP,
+    OP_GETATTR,
+    OP_SETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_CREATE,
+    OP_READ,
+    OP_WRITE,
+    OP_FLUSH,
+    OP_RELEASE,
+    OP_FSYNC,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_UNLINK,
+    OP_RENAME,
+    OP_STATFS,
+    OP_IOCTL,
+    SFS_NOPS
+};
+
+static const char *const op_names[SFS_NOPS] = {
+    "lookup", "getattr", "setattr", "readdir", "open", "create", "read",
+    "write", "flush", "release", "fsync", "mkdir", "rmdir", "unlink",
+    "rename", "statfs", "ioctl",
+};
+
+static const char *const disk_op_names[DISK_NOPS] = {
+    "read", "write", "batch", "prefetch", "sync", "copy",
+};
+
+struct sfs_op_stats {
+    struct op_stats ops[SFS_NOPS];
+};
+
+/* Set up by main; nothing is counted without it. */
+static struct stats_set *op_stats_set;
+
+/* Result of the low-level request being handled by this thread: < 0 for an
+ * error, otherwise the number of bytes moved (see ll_reply_err). */
+static __thread long op_res;
+
+static unsigned long stats_seq;
+
+
+static void stats_print_ops(FILE *f, const char *const *names,
+                            const struct op_stats *ops, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        const struct op_stats *st = &ops[i];
+
+        fprintf(f, "    \"%s\": {\"calls\": %lu, \"errors\": %lu, "
+                "\"bytes\": %lu, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                "\"p99_us\": %.3f, \"hist\": [", names[i], st->calls,
+                st->errors, st->bytes,
+                st->calls ? st->ns / 1000.0 / st->calls : 0.0,
+                op_stats_percentile(st, 50) / 1000.0,
+                op_stats_percentile(st, 99) / 1000.0);
+        for (unsigned b = 0; b < OP_STATS_BUCKETS; b++) {
+            fprintf(f, b ? ", %lu" : "%lu", st->hist[b]);
+        }
+        fprintf(f, "]}%s\n", i + 1 < n ? "," : "");
+    }
+}
+
+
+/* Print all statistics as the members of a JSON object, and close it. The
+ * latency histograms are explained in diskio.h (OP_STATS_BUCKETS). */
+static void stats_print(FILE *f)
+{
+    struct disk_stats ds;
+    struct sfs_op_stats os;
+
+    disk_get_stats(&ds);
+    if (op_stats_set) {
+        stats_sum(op_stats_set, &os);
+    } else {
+        memset(&os, 0, sizeof(os));
+    }
+
+    unsigned long lookups = ds.cache_hits + ds.cache_misses;
+
+    fprintf(f, "  \"disk\": {\"reads\": %lu, \"writes\": %lu, "
+            "\"read_bytes\": %lu, \"write_bytes\": %lu, \"syscalls\": %lu},\n",
+            ds.reads, ds.writes, ds.read_bytes, ds.write_bytes, ds.syscalls);
+    fprintf(f, "  \"cache\": {\"hits\": %lu, \"misses\": %lu, "
+            "\"hit_ratio\": %.4f},\n", ds.cache_hits, ds.cache_misses,
+            lookups ? (double)ds.cache_hits / lookups : 0.0);
+
+    fprintf(f, "  \"disk_ops\": {\n");
+    stats_print_ops(f, disk_op_names, ds.ops, DISK_NOPS);
+    fprintf(f, "  },\n  \"ops\": {\n");
+    stats_print_ops(f, op_names, os.ops, SFS_NOPS);
+    fprintf(f, "  }\n}\n");
+}
+
+
+static void stats_dump(void)
+{
+    char tmp[PATH_MAX];
+    FILE *f = stderr;
+
+    if (options.stats) {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", options.stats);
+        if (!(f = fopen(tmp, "w"))) {
+            return;
+        }
+    }
+
+    fprintf(f, "{\n  \"seq\": %lu,\n", ++stats_seq);
+    stats_print(f);
+
+    if (options.stats && fclose(f) == 0) {
+        rename(tmp, options.stats);
+    }
+}
+
+
+static void *stats_main(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;) {
+        if (sigwait(&set, &sig) == 0 && sig == SIGUSR1) {
+            stats_dump();
+        }
+    }
+    return NULL;
+}
+
+
+static void stats_start(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, stats_main, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+
+/*
+ * Tracing (--trace=FILE, or -v). Every callback adds a fixed-size binary
+ * record to a ring buffer of its own thread, without locks or system calls;
+ * a background thread (trace_main) drains the rings every TRACE_INTERVAL_MS
+ * into FILE, or prints them to stdout with -v. A thread whose ring is full
+ * drops its records, which is noted in the trace with a TRACE_DROPPED record.
+ *
+ * Each ring has a single producer (its thread) and a single consumer (the
+ * drain thread): the producer only moves `head` and the consumer only `tail`.
+ * The rings are per-thread areas of a stats_set, so the ring of a thread that
+ * exits is taken over by the next new one.
+ *
+ * A trace file starts with a header: the magic "SFSTRACE", and then as 32-bit
+ * words the format version, the size of a record, and the number of
+ * operations, followed by the name of every operation as a NUL-terminated
+ * string. After that come the records (struct trace_rec), in the byte order
+ * of the machine; see trace.py to decode them. Records are written per ring,
+ * so they are ordered by start time only within a thread.
+ */
+#define TRACE_MAGIC         "SFSTRACE"
+#define TRACE_VERSION       1
+#define TRACE_RING_SIZE     4096u
+#define TRACE_INTERVAL_MS   100
+
+/* Record of dropped records, with their number in `size`. */
+#define TRACE_DROPPED       0x7fff
+/* Set in `op` when `key` is an inode number rather than a name hash. */
+#define TRACE_INO           0x8000
+
+struct trace_rec {
+    uint64_t start_ns;          /* CLOCK_MONOTONIC */
+    uint64_t key;               /* Hash of the path or name, or inode */
+    int64_t offset;
+    uint32_t dur_ns;
+    uint32_t size;
+    int32_t result;             /* Bytes moved, or -errno */
+    uint16_t op;                /* enum sfs_op, plus TRACE_INO */
+    uint16_t ring;              /* Identifies the thread */
+};
+
+struct trace_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t dropped_seen;      /* Part of `dropped` already reported */
+    uint64_t id;
+    struct trace_rec recs[TRACE_RING_SIZE];
+};
+
+/* Set up by main when tracing. */
+static struct stats_set *trace_set;
+static FILE *trace_file;
+static unsigned trace_rings;
+static int trace_stop_flag;
+static pthread_t trace_thread;
+static int trace_running;
+
+
+/* `ts` in ns, as a single number. */
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+/* FNV-1a hash of `name`, starting from `seed` (e.g. the parent inode). */
+static uint64_t trace_hash(const char *name, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+/* Add a record for `op` to the calling thread's ring. `name` is the path or
+ * name involved, hashed with `ino` (the parent), or NULL if the operation is
+ * on inode `ino` itself. */
+static void trace_add(enum sfs_op op, const struct timespec *start,
+                      unsigned long ns, long res, fuse_ino_t ino,
+                      const char *name, off_t offset, size_t size)
+{
+    struct trace_ring *r = stats_local(trace_set);
+
+    if (!r) {
+        return;
+    }
+    if (!r->id) {
+        __atomic_store_n(&r->id, __atomic_add_fetch(&trace_rings, 1,
+                                                    __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+    }
+
+    uint64_t head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+            >= TRACE_RING_SIZE) {
+        STATS_ADD(r->dropped, 1);
+        return;
+    }
+
+    struct trace_rec *t = &r->recs[head % TRACE_RING_SIZE];
+
+    t->start_ns = timespec_ns(start);
+    t->key = name ? trace_hash(name, ino) : ino;
+    t->offset = offset;
+    t->dur_ns = ns > UINT32_MAX ? UINT32_MAX : ns;
+    t->size = size > UINT32_MAX ? UINT32_MAX : size;
+    t->result = res;
+    t->op = op | (name ? 0 : TRACE_INO);
+    t->ring = r->id;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void trace_write(const struct trace_rec *t)
+{
+    if (trace_file) {
+        fwrite(t, sizeof(struct trace_rec), 1, trace_file);
+        return;
+    }
+
+    unsigned op = t->op & ~TRACE_INO;
+
+    if (op == TRACE_DROPPED) {
+        printf(" # [%u] dropped %u records\n", t->ring, t->size);
+        return;
+    }
+    printf(" # [%u] %s %s=%#" PRIx64 " offset=%" PRId64 " size=%u = %d"
+           " (%.1f us)\n", t->ring, op < SFS_NOPS ? op_names[op] : "?",
+           t->op & TRACE_INO ? "ino" : "hash", t->key, t->offset, t->size,
+           t->result, t->dur_ns / 1000.0);
+}
+
+
+/* Write out the records in ring `area`. Called through stats_each. */
+static void trace_drain_ring(void *area, void *arg)
+{
+    struct trace_ring *r = area;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+
+    (void)arg;
+
+    for (uint64_t i = r->tail; i < head; i++) {
+        trace_write(&r->recs[i % TRACE_RING_SIZE]);
+    }
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+    if (dropped != r->dropped_seen) {
+        struct trace_rec t;
+
+        memset(&t, 0, sizeof(t));
+        t.op = TRACE_DROPPED;
+        t.size = dropped - r->dropped_seen;
+        t.ring = __atomic_load_n(&r->id, __ATOMIC_RELAXED);
+        trace_write(&t);
+        r->dropped_seen = dropped;
+    }
+}
+
+
+static void trace_drain(void)
+{
+    stats_each(trace_set, trace_drain_ring, NULL);
+    fflush(trace_file ? trace_file : stdout);
+}
+
+
+static void *trace_main(void *arg)
+{
+    struct timespec delay = { 0, TRACE_INTERVAL_MS * 1000000L };
+
+    (void)arg;
+    while (!__atomic_load_n(&trace_stop_flag, __ATOMIC_ACQUIRE)) {
+        nanosleep(&delay, NULL);
+        trace_drain();
+    }
+    return NULL;
+}
+
+
+/* Write the header shared by capture and trace files: the format version,
+ * record size and operation names. */
+static void write_op_header(FILE *f, uint32_t version, uint32_t recsize)
+{
+    uint32_t hdr[3] = { version, recsize, SFS_NOPS };
+
+    fwrite(hdr, sizeof(hdr), 1, f);
+    for (unsigned i = 0; i < SFS_NOPS; i++) {
+        fwrite(op_names[i], strlen(op_names[i]) + 1, 1, f);
+    }
+}
+
+
+/* Open the trace file and write its header. Exits on failure. */
+static void trace_open(const char *path)
+{
+    trace_set = stats_set_new(sizeof(struct trace_ring));
+    if (!trace_set) {
+        fprintf(stderr, "Could not set up tracing\n");
+        exit(1);
+    }
+    if (!path) {
+        return;
+    }
+
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        perror("Could not open trace file");
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, trace_file);
+    write_op_header(trace_file, TRACE_VERSION, sizeof(struct trace_rec));
+    fflush(trace_file);
+}
+
+
+static void trace_start(void)
+{
+    if (trace_set && !trace_running
+            && pthread_create(&trace_thread, NULL, trace_main, NULL) == 0) {
+        trace_running = 1;
+    }
+}
+
+
+/* Stop the drain thread and write out whatever is left. */
+static void trace_stop(void)
+{
+    if (!trace_set) {
+        return;
+    }
+    if (trace_running) {
+        __atomic_store_n(&trace_stop_flag, 1, __ATOMIC_RELEASE);
+        pthread_join(trace_thread, NULL);
+        trace_running = 0;
+    }
+    trace_drain();
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+
+/*
+ * Count a call of `op` that started at `start` and returned `res`: < 0 for an
+ * error, otherwise the number of bytes read or written, if any. `ino`, `name`,
+ * `offset` and `size` describe the call for the trace (see trace_add).
+ * Returns the duration of the call in ns, if it was measured.
+ */
+static unsigned long op_end(enum sfs_op op, const struct timespec *start,
+                            long res, fuse_ino_t ino, const char *name,
+                            off_t offset, size_t size)
+{
+    struct sfs_op_stats *st = op_stats_set ? stats_local(op_stats_set) : NULL;
+    unsigned long ns = 0;
+
+    if (st) {
+        ns = op_stats_end(&st->ops[op], start, res > 0 ? res : 0, res < 0);
+    }
+    if (trace_set) {
+        trace_add(op, start, ns, res, ino, name, offset, size);
+    }
+    return ns;
+}
+
+
+/*
+ * Capture (--capture=FILE). Every call through the path-based interface is
+ * appended to FILE as it completes, with its arguments, result and timing, so
+ * that the workload can later be replayed against an image without FUSE (see
+ * replay_main). Unlike the trace, the capture keeps the paths themselves and
+ * the global order of the calls, at the cost of a lock around each record.
+ *
+ * The file starts with the magic "SFSCAPT1", and then as 32-bit words the
+ * format version, the size of a record and the number of operations, followed
+ * by the name of every operation as a NUL-terminated string. Each record
+ * (struct capture_rec) is followed by `path_len` bytes: the path, and for a
+ * rename a NUL and the new path.
+ */
+#define CAPTURE_MAGIC       "SFSCAPT1"
+#define CAPTURE_VERSION     1
+
+struct capture_rec {
+    uint64_t start_ns;          /* Since the start of the capture */
+    uint64_t fh;                /* Id of the open file, or 0 */
+    int64_t offset;             /* Or the new size, for truncate */
+    uint32_t dur_ns;
+    uint32_t size;
+    uint32_t flags;             /* Open flags, for open and create */
+    int32_t result;             /* Bytes moved, or -errno */
+    uint16_t op;                /* enum sfs_op */
+    uint16_t path_len;
+    uint32_t reserved;
+};
+
+static FILE *capture_file;
+static uint64_t capture_start_ns;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Open the capture file and write its header. Exits on failure. */
+static void capture_open(const char *path)
+{
+    struct timespec now;
+
+    capture_file = fopen(path, "w");
+    if (!capture_file) {
+        perror("Could not open capture file");
+        exit(1);
+    }
+    fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, capture_file);
+    write_op_header(capture_file, CAPTURE_VERSION, sizeof(struct capture_rec));
+    fflush(capture_file);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    capture_start_ns = timespec_ns(&now);
+}
+
+
+static uint64_t capture_fh(const struct fuse_file_info *fi);
+
+
+/*
+ * Record a call of `op` on `path` (and `newpath`, for rename) that started at
+ * `start`, took `ns` and returned `res`. `fh` is the id of the open file the
+ * call was made with, taken before the call, as release frees the handle; if
+ * it is 0, that of the handle the call left in `fi` is recorded instead, which
+ * is how open and create get theirs.
+ */
+static void capture_add(enum sfs_op op, const struct timespec *start,
+                        unsigned long ns, int res, const char *path,
+                        const char *newpath, off_t offset, size_t size,
+                        uint64_t fh, const struct fuse_file_info *fi)
+{
+    struct capture_rec c;
+    size_t pathLen = strlen(path);
+    size_t newLen = newpath ? strlen(newpath) + 1 : 0;
+
+    if (pathLen + newLen > UINT16_MAX) {
+        return;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.start_ns = timespec_ns(start) - capture_start_ns;
+    c.fh = fh ? fh : capture_fh(fi);
+    c.offset = offset;
+    c.dur_ns = ns > UINT32_MAX ? UINT32_MAX : ns;
+    c.size = size > UINT32_MAX ? UINT32_MAX : size;
+    c.flags = fi ? fi->flags : 0;
+    c.result = res;
+    c.op = op;
+    c.path_len = pathLen + newLen;
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file) {
+        fwrite(&c, sizeof(c), 1, capture_file);
+        fwrite(path, pathLen, 1, capture_file);
+        if (newpath) {
+            fwrite("", 1, 1, capture_file);
+            fwrite(newpath, newLen - 1, 1, capture_file);
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+
+static void capture_close(void)
+{
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+
+/*
+ * The virtual file /.sfs_stats. It does not appear in directory listings, and
+ * can only be opened for reading. Every open takes a snapshot of the
+ * statistics, which is what reads of that file descriptor return; fi->fh then
+ * points to the snapshot, tagged with FH_STATS so that it is not mistaken for
+ * an sfs_handle. The file is opened with direct_io, as its size is unknown
+ * until it is opened.
+ */
+#define STATS_NAME  ".sfs_stats"
+#define FH_STATS    1u
+
+/* The inode number of a slot just past the end of the image (see entry_ino),
+ * which is above that of every entry. */
+#define STATS_INO   ((fuse_ino_t)SLOT_COUNT + 2)
+
+struct stats_snap {
+    uint64_t id;
+    size_t len;
+    char data[];
+};
+
+
+static int is_stats_name(blockidx_t dir, const char *name)
+{
+    return dir == DIR_ROOT && strcmp(name, STATS_NAME) == 0;
+}
+
+
+/* The snapshot of an open /.sfs_stats, or NULL for any other file. */
+static struct stats_snap *stats_snap(const struct fuse_file_info *fi)
+{
+    if (!(fi->fh & FH_STATS)) {
+        return NULL;
+    }
+    return (struct stats_snap *)(uintptr_t)(fi->fh & ~(uint64_t)FH_STATS);
+}
+
+
+/* Id of the file open in `fi` as recorded in the capture, or 0 if none. */
+static uint64_t capture_fh(const struct fuse_file_info *fi)
+{
+    if (!fi || !fi->fh) {
+        return 0;
+    }
+    if (stats_snap(fi)) {
+        return stats_snap(fi)->id;
+    }
+    return ((struct sfs_handle *)(uintptr_t)fi->fh)->id;
+}
+
+
+static void stats_fill_stat(struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = STATS_INO;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+}
+
+
+static int stats_open(struct fuse_file_info *fi)
+{
+    char *data;
+    size_t len;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+
+    FILE *f = open_memstream(&data, &len);
+    if (!f) {
+        return -ENOMEM;
+    }
+    fputs("{\n", f);
+    stats_print(f);
+    fclose(f);
+
+    struct stats_snap *snap = malloc(sizeof(struct stats_snap) + len);
+    if (!snap) {
+        free(data);
+        return -ENOMEM;
+    }
+    snap->id = open_new_id();
+    snap->len = len;
+    memcpy(snap->data, data, len);
+    free(data);
+
+    fi->fh = (uintptr_t)snap | FH_STATS;
+    fi->direct_io = 1;
+    fi->keep_cache = 0;
+    return 0;
+}
+
+
+/* Copy up to `size` bytes at `offset` of a snapshot to `buf`. Returns the
+ * number of bytes copied. */
+static size_t stats_read(const struct stats_snap *snap, char *buf, size_t size,
+                         off_t offset)
+{
+    if (offset < 0 || (size_t)offset >= snap->len) {
+        return 0;
+    }
+    if (size > snap->len - offset) {
+        size = snap->len - offset;
+    }
+    memcpy(buf, snap->data + offset, size);
+    return size;
+}
+
+
+/*
+ * Inode number of the entry stored at disk offset `entry_off`. Entries only
+ * move when they are renamed into another directory, so this is stable for
+ * the lifetime of the entry otherwise, and it is unique because entries are
+ * 64-byte aligned relative to the start of the root directory. The root
+ * directory itself is inode 1.
+ */
+static ino_t entry_ino(unsigned entry_off)
+{
+    return (entry_off - SFS_ROOTDIR_OFF) / sizeof(struct sfs_entry) + 2;
+}
+
+
+/* Fill `st` for `entry` (stored at `entry_off`), or for the root directory if
+ * `entry` is NULL. */
+static void fill_stat(const struct sfs_entry *entry, unsigned entry_off,
+                      struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+
+    if (!entry) {
+        st->st_ino = 1;
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else if (entry->size & SFS_DIRECTORY) {
+        st->st_ino = entry_ino(entry_off);
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        st->st_size = 0;
+    } else {
+        st->st_ino = entry_ino(entry_off);
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = entry->size & SFS_SIZEMASK;
+    }
+}
+
+
+/*
+ * Retrieve information about a file or directory.
+ * You should populate fields of `st` with appropriate information if the
+ * file exists and is accessible, or return an error otherwise.
+ *
+ * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
+ * For files, you should at least set st_mode (with S_IFREG), st_nlink and
+ * st_size.
+ *
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_getattr(const char *path,
+                       struct stat *st)
+{
+    if (strcmp(path, "/") == 0) {
+        fill_stat(NULL, 0, st);
+        return 0;
+    }
+    if (strcmp(path, "/" STATS_NAME) == 0) {
+        stats_fill_stat(st);
+        return 0;
+    }
+
+    struct sfs_entry entry;
+    unsigned entryAddr;
+
+    pthread_rwlock_rdlock(&ns_lock);
+    int res = get_entry(path, &entry, &entryAddr);
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res != 0){
+        return res;
+    }
+
+    fill_stat(&entry, entryAddr, st);
+
+    return 0;
+}
+
+/*
+ * Return directory contents for `path`. Every entry is passed to `filler`
+ * together with its attributes, and is added to the dentry cache, so the
+ * getattr calls that typically follow a listing (e.g., `ls -l`) are answered
+ * from memory.
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_readdir(const char *path,
+                       void *buf,
+                       fuse_fill_dir_t filler,
+                       off_t offset,
+                       struct fuse_file_info *fi)
+{
+    (void)offset, (void)fi;
+
+    struct sfs_dir d;
+    blockidx_t dir = DIR_ROOT;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if (strcmp(path, "/") != 0) {
+        struct sfs_entry dirEntry;
+
+        int res = get_entry(path, &dirEntry, NULL);
+        if (res == 0 && !(dirEntry.size & SFS_DIRECTORY)) {
+            res = -ENOTDIR;
+        }
+        if (res != 0) {
+            pthread_rwlock_unlock(&ns_lock);
+            return res;
+        }
+        dir = dirEntry.first_block;
+    }
+
+    pthread_rwlock_rdlock(dir_lock(dir));
+
+    unsigned gen = dcache_snapshot();
+    dir_load(dir, &d);
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    for (unsigned i = 0; i < d.nentries; i++) {
+        const struct sfs_entry *entry = &d.entries[i];
+        struct stat st;
+
+        if (!dir_entry_used(entry)) {
+            continue;
+        }
+
+        fill_stat(entry, dir_entry_off(&d, i), &st);
+        dcache_fill(dir, entry->filename, entry, dir_entry_off(&d, i), gen);
+
+        if (filler(buf, entry->filename, &st, 0)) {
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(dir_lock(dir));
+    pthread_rwlock_unlock(&ns_lock);
+
+    return 0;
+}
+
+static int sfs_open(const char *path, struct fuse_file_info *fi);
+
+
+/* Handle to do I/O through for a request on `path`: the one in fi->fh, or a
+ * temporary one if the request comes without an open file. */
+static int io_handle_get(const char *path, struct fuse_file_info *fi,
+                         struct sfs_handle **ret_h)
+{
+    struct fuse_file_info tmp;
+
+    *ret_h = (struct sfs_handle *)(uintptr_t)fi->fh;
+    if (*ret_h) {
+        return 0;
+    }
+
+    memset(&tmp, 0, sizeof(tmp));
+    int res = sfs_open(path, &tmp);
+    if (res == 0 && stats_snap(&tmp)) {
+        free(stats_snap(&tmp));
+        res = -EACCES;
+    }
+    if (res == 0) {
+        *ret_h = (struct sfs_handle *)(uintptr_t)tmp.fh;
+    }
+    return res;
+}
+
+
+/* Done with a handle obtained from io_handle_get. */
+static void io_handle_put(struct sfs_handle *h, struct fuse_file_info *fi)
+{
+    if (h != (struct sfs_handle *)(uintptr_t)fi->fh) {
+        handle_close(h);
+    }
+}
+
+
+/* Read through handle `h`, continuing from its cursor. Readahead is only done
+ * if `ra` is set, i.e., for handles that live longer than this request.
+ * Returns the number of bytes read, or < 0 on error. */
+static int handle_read(struct sfs_handle *h, char *buf, size_t size,
+                       off_t offset, int ra)
+{
+    struct sfs_node *node = h->node;
+    struct chain_pos pos;
+
+    pthread_rwlock_rdlock(&node->lock);
+
+    handle_load_pos(h, &pos);
+    int res = read_chain(node->entry.first_block,
+                         node->entry.size & SFS_SIZEMASK,
+                         buf, size, offset, &pos);
+    handle_save_pos(h, &pos);
+
+    if (options.cache_mb && ra) {
+        readahead(h, &pos, offset, res);
+    }
+
+    pthread_rwlock_unlock(&node->lock);
+
+    return res;
+}
+
+
+/*
+ * Read through handle `h` like handle_read, but return the data as a new
+ * bufvec in *ret_buf, to be freed with bufvec_free. Where the image can be
+ * accessed directly (see disk_fd), the bufvec holds no data but one
+ * FUSE_BUF_IS_FD segment per extent of the file in the image, so fuse can
+ * splice the data to the kernel without it ever passing through this process.
+ * Otherwise the data is read into memory. The segments point at the file's
+ * blocks as they are now, so the caller must hold the node's lock for reading
+ * until the data has been copied out.
+ * Returns the number of bytes read, or < 0 on error.
+ */
+static int handle_read_buf(struct sfs_handle *h, size_t size, off_t offset,
+                           struct fuse_bufvec **ret_buf)
+{
+    struct sfs_node *node = h->node;
+    size_t fsize = node->entry.size & SFS_SIZEMASK;
+    struct chain_ext ext[IO_BATCH];
+    struct chain_pos pos;
+    int fd = disk_fd();
+    size_t mapped = 0;
+    unsigned n = 0;
+
+    if ((size_t)offset >= fsize) {
+        size = 0;
+    } else if (size > fsize - offset) {
+        size = fsize - offset;
+    }
+
+    handle_load_pos(h, &pos);
+
+    if (fd >= 0 && size) {
+        n = chain_map(node->entry.first_block, size, offset, &pos, ext,
+                      IO_BATCH, &mapped);
+    }
+
+    if (n && mapped == size) {
+        *ret_buf = bufvec_extents(fd, ext, n);
+    } else {
+        char *buf = malloc(size ? size : 1);
+
+        *ret_buf = buf ? bufvec_alloc(1) : NULL;
+        if (*ret_buf) {
+            size = read_chain(node->entry.first_block, fsize, buf, size,
+                              offset, &pos);
+            (*ret_buf)->buf[0].mem = buf;
+            (*ret_buf)->buf[0].size = size;
+        } else {
+            free(buf);
+        }
+
+        if (options.cache_mb) {
+            readahead(h, &pos, offset, size);
+        }
+    }
+
+    handle_save_pos(h, &pos);
+
+    return *ret_buf ? (int)size : -ENOMEM;
+}
+
+
+/* Write the data in `src` through handle `h`, continuing from its cursor (see
+ * write_node). */
+static int handle_write(struct sfs_handle *h, struct fuse_bufvec *src,
+                        off_t offset)
+{
+    struct sfs_node *node = h->node;
+    struct chain_pos pos;
+
+    pthread_rwlock_wrlock(&node->lock);
+
+    handle_load_pos(h, &pos);
+    int res = write_node(node, src, offset, &pos);
+    handle_save_pos(h, &pos);
+
+    pthread_rwlock_unlock(&node->lock);
+
+    return res;
+}
+
+/*
+ * Read contents of `path` into `buf` for  up to `size` bytes.
+ * Note that `size` may be bigger than the file actually is.
+ * Reading should start at offset `offset`; the OS will generally read your file
+ * in chunks of 4K byte.
+ * Returns the number of bytes read (writting into `buf`), or < 0 on error.
+ */
+static int sfs_read(const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    if (stats_snap(fi)) {
+        return stats_read(stats_snap(fi), buf, size, offset);
+    }
+
+    struct sfs_handle *h;
+    int res = io_handle_get(path, fi, &h);
+
+    if (res != 0) {
+        return res;
+    }
+
+    res = handle_read(h, buf, size, offset,
+                      h == (struct sfs_handle *)(uintptr_t)fi->fh);
+
+    io_handle_put(h, fi);
+
+    return res;
+}
+
+/* Create directory `name` in `parent`. The caller must hold ns_lock. */
+static int do_mkdir(blockidx_t parent, const char *name)
+{
+    if (strlen(name) > SFS_FILENAME_MAX - 1) {
+        return -ENAMETOOLONG;
+    }
+    if (is_stats_name(parent, name)) {
+        return -EEXIST;
+    }
+
+    /* A subdirectory always occupies two consecutive blocks. */
+    unsigned nblk;
+    blockidx_t b1 = alloc_run(SFS_BLOCKIDX_END, 2, &nblk);
+
+    if (nblk < 2) {
+        if (nblk) {
+            alloc_release(b1, nblk);
+        }
+        return -ENOSPC;
+    }
+
+    blockidx_t b2 = b1 + 1;
+
+    struct sfs_entry emptyEntries[2 * DIR_ENTRIES_PER_BLK];
+
+    memset(emptyEntries, 0, sizeof(emptyEntries));
+
+    for (unsigned i = 0; i < 2 * DIR_ENTRIES_PER_BLK; i++) {
+        emptyEntries[i].first_block = SFS_BLOCKIDX_EMPTY;
+    }
+
+    disk_write(emptyEntries, sizeof(emptyEntries), SFS_DATA_OFF + (b1 * SFS_BLOCK_SIZE));
+
+    blockidx_t blks[2] = { b1, b2 };
+
+    blocktbl[b1] = b2;
+    blocktbl[b2] = SFS_BLOCKIDX_END;
+    blocktbl_sync(blks, 2);
+
+    struct sfs_entry newEntry;
+    unsigned entryAddr;
+
+    memset(&newEntry, 0, sizeof(struct sfs_entry));
+    strncpy(newEntry.filename, name, SFS_FILENAME_MAX - 1);
+    newEntry.first_block = b1;
+    newEntry.size = SFS_DIRECTORY;
+
+    pthread_rwlock_wrlock(dir_lock(parent));
+    int res = dir_add(parent, &newEntry, &entryAddr);
+    pthread_rwlock_unlock(dir_lock(parent));
+
+    if (res != 0) {
+        free_chain(b1);
+    }
+
+    return res;
+}
+
+
+/*
+ * Create directory at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_mkdir(const char *path, mode_t mode)
+{
+    (void)mode;
+
+    blockidx_t parent;
+    const char *newName;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &newName);
+    if (res == 0) {
+        res = do_mkdir(parent, newName);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+/* Remove the empty directory `name` from `parent`. The caller must hold ns_lock
+ * for writing, which excludes all other namespace operations. */
+static int do_rmdir(blockidx_t parent, const char *name)
+{
+    struct sfs_entry entry;
+    unsigned int entryAddr;
+
+    if (is_stats_name(parent, name)) {
+        return -ENOTDIR;
+    }
+
+    int res = dir_get(parent, name, &entry, &entryAddr);
+    if (res != 0) {
+        return res;
+    }
+    if (!(entry.size & SFS_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+
+    if (!dir_is_empty(entry.first_block)) {
+        return -ENOTEMPTY;
+    }
+
+    dir_remove(parent, name, &entry, entryAddr);
+    free_chain(entry.first_block);
+
+    return 0;
+}
+
+
+/*
+ * Remove directory at `path`.
+ * Directories may only be removed if they are empty, otherwise this function
+ * should return -ENOTEMPTY.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_rmdir(const char *path)
+{
+    blockidx_t parent;
+    const char *name;
+
+    pthread_rwlock_wrlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &name);
+    if (res == 0) {
+        res = do_rmdir(parent, name);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+/* Remove the file `entry`, stored at `entry_off` as `name` in `parent`. Its
+ * data is freed now, or when the last handle to it is closed if it is open
+ * (see node_put). The caller must hold the directory's lock for writing. */
+static void remove_file(blockidx_t parent, const char *name,
+                        const struct sfs_entry *entry, unsigned entry_off)
+{
+    struct sfs_node *node = node_begin_update(entry_off);
+
+    if (node) {
+        dir_remove(parent, name, &node->entry, entry_off);
+        node_unlink(node);
+    } else {
+        dir_remove(parent, name, entry, entry_off);
+        free_chain(entry->first_block);
+    }
+    node_end_update(node);
+}
+
+
+/* Remove file `name` from `parent`. The caller must hold ns_lock. */
+static int do_unlink(blockidx_t parent, const char *name)
+{
+    struct sfs_entry entry;
+    unsigned int entryAddr;
+
+    if (is_stats_name(parent, name)) {
+        return -EACCES;
+    }
+
+    pthread_rwlock_wrlock(dir_lock(parent));
+
+    int res = dir_get(parent, name, &entry, &entryAddr);
+    if (res == 0 && (entry.size & SFS_DIRECTORY)) {
+        res = -EISDIR;
+    }
+
+    if (res == 0) {
+        remove_file(parent, name, &entry, entryAddr);
+    }
+
+    pthread_rwlock_unlock(dir_lock(parent));
+
+    return res;
+}
+
+
+/*
+ * Remove file at `path`.
+ * Can not be used to remove directories.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_unlink(const char *path)
+{
+    blockidx_t parent;
+    const char *name;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &name);
+    if (res == 0) {
+        res = do_unlink(parent, name);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+/* Create an empty file `name` in `parent` and open it. The caller must hold
+ * ns_lock. */
+static int do_create(blockidx_t parent, const char *name,
+                     struct fuse_file_info *fi)
+{
+    if (strlen(name) > SFS_FILENAME_MAX - 1) {
+        return -ENAMETOOLONG;
+    }
+    if (is_stats_name(parent, name)) {
+        return -EEXIST;
+    }
+
+    struct sfs_entry newFile;
+    unsigned entryAddr;
+
+    memset(&newFile, 0, sizeof(newFile));
+    strncpy(newFile.filename, name, SFS_FILENAME_MAX - 1);
+    newFile.first_block = SFS_BLOCKIDX_END;
+    newFile.size = 0;
+
+    pthread_rwlock_wrlock(dir_lock(parent));
+
+    int res = dir_add(parent, &newFile, &entryAddr);
+    if (res == 0) {
+        res = handle_open(entryAddr, &newFile, fi);
+    }
+
+    pthread_rwlock_unlock(dir_lock(parent));
+
+    return res;
+}
+
+
+/*
+ * Create an empty file at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void)mode;
+    
+
+    blockidx_t parent;
+    const char *newName;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &newName);
+    if (res == 0) {
+        res = do_create(parent, newName, fi);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+
+/* Open file `name` in `parent`. The lookup and the creation of the handle are
+ * done under the directory lock, so the file cannot be unlinked in between.
+ * The caller must hold ns_lock. */
+static int do_open(blockidx_t parent, const char *name,
+                   struct fuse_file_info *fi)
+{
+    struct sfs_entry entry;
+    unsigned int entryAddr;
+
+    if (is_stats_name(parent, name)) {
+        return stats_open(fi);
+    }
+
+    pthread_rwlock_rdlock(dir_lock(parent));
+
+    int res = dir_get(parent, name, &entry, &entryAddr);
+    if (res == 0 && (entry.size & SFS_DIRECTORY)) {
+        res = -EISDIR;
+    }
+    if (res == 0) {
+        res = handle_open(entryAddr, &entry, fi);
+    }
+
+    pthread_rwlock_unlock(dir_lock(parent));
+
+    return res;
+}
+
+
+/*
+ * Open the file at `path`. The resolved entry is kept in a handle stored in
+ * fi->fh, which read and write use instead of looking up the path again.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_open(const char *path, struct fuse_file_info *fi)
+{
+    blockidx_t parent;
+    const char *name;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &name);
+    if (res == 0) {
+        res = do_open(parent, name, fi);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+
+/*
+ * Release an open file: called once all file descriptors referring to the
+ * handle created by open/create are closed.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_release(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    struct sfs_handle *h = (struct sfs_handle *)(uintptr_t)fi->fh;
+
+    if (stats_snap(fi)) {
+        free(stats_snap(fi));
+    } else if (h) {
+        handle_close(h);
+    }
+    fi->fh = 0;
+
+    return 0;
+}
+
+
+/*
+ * Shrink or grow the file at `path` to `size` bytes.
+ * Excess bytes are thrown away, whereas any bytes added in the process should
+ * be nil (\0).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_truncate(const char *path, off_t size)
+{
+    struct fuse_file_info fi;
+    struct sfs_handle *h;
+
+    memset(&fi, 0, sizeof(fi));
+    int res = io_handle_get(path, &fi, &h);
+    if (res != 0) {
+        return res;
+    }
+
+    pthread_rwlock_wrlock(&h->node->lock);
+    res = truncate_node(h->node, size);
+    pthread_rwlock_unlock(&h->node->lock);
+
+    io_handle_put(h, &fi);
+
+    return res;
+}
+
+
+/*
+ * Write contents of `buf` (of `size` bytes) to the file at `path`.
+ * The file is grown if nessecary, and any bytes already present are overwritten
+ * (whereas any other data is left intact). The `offset` argument specifies how
+ * many bytes should be skipped in the file, after which `size` bytes from
+ * buffer are written.
+ * This means that the new file size will be max(old_size, offset + size).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write(const char *path,
+                     const char *buf,
+                     size_t size,
+                     off_t offset,
+                     struct fuse_file_info *fi)
+{
+    struct sfs_handle *h;
+    int res = io_handle_get(path, fi, &h);
+
+    if (res != 0) {
+        return res;
+    }
+
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+    src.buf[0].mem = (void *)buf;
+    res = handle_write(h, &src, offset);
+
+    io_handle_put(h, fi);
+
+    return res;
+}
+
+
+/*
+ * Like sfs_write, for data that fuse may have left in a pipe, from which it is
+ * spliced into the image where possible (see chain_write_buf).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    struct sfs_handle *h;
+    int res = io_handle_get(path, fi, &h);
+
+    if (res != 0) {
+        return res;
+    }
+
+    res = handle_write(h, buf, offset);
+
+    io_handle_put(h, fi);
+
+    return res;
+}
+
+
+/*
+ * Rename `name` in `parent` to `newname` in `newparent`, replacing an entry of
+ * that name: a file by a file, or an empty directory by a directory. Within
+ * one directory the entry is renamed in place. Otherwise it moves to a free
+ * slot of `newparent`, which gives it a new inode number (see entry_ino); an
+ * open file's node moves along with it. The caller must hold ns_lock for
+ * writing.
+ */
+static int do_rename(blockidx_t parent, const char *name,
+                     blockidx_t newparent, const char *newname)
+{
+    struct sfs_entry entry, target;
+    unsigned entryAddr, targetAddr;
+
+    if (is_stats_name(parent, name) || is_stats_name(newparent, newname)) {
+        return -EACCES;
+    }
+
+    int res = dir_get(parent, name, &entry, &entryAddr);
+    if (res != 0) {
+        return res;
+    }
+
+    int hasTarget = dir_get(newparent, newname, &target, &targetAddr);
+    if (hasTarget != 0 && hasTarget != -ENOENT) {
+        return hasTarget;
+    }
+    hasTarget = hasTarget == 0;
+    if (hasTarget && targetAddr == entryAddr) {
+        return 0;
+    }
+
+    if (entry.size & SFS_DIRECTORY) {
+        res = dir_is_below(newparent, entry.first_block);
+        if (res != 0) {
+            return res < 0 ? res : -EINVAL;
+        }
+    }
+    if (hasTarget && (target.size & SFS_DIRECTORY)) {
+        if (!(entry.size & SFS_DIRECTORY)) {
+            return -EISDIR;
+        }
+        if (!dir_is_empty(target.first_block)) {
+            return -ENOTEMPTY;
+        }
+    } else if (hasTarget && (entry.size & SFS_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+
+    /* The target goes first, which also makes room for the entry if it
+     * moves, and before the entry's node is locked: two node locks are
+     * never held at once here. */
+    if (hasTarget && (target.size & SFS_DIRECTORY)) {
+        dir_remove(newparent, newname, &target, targetAddr);
+        free_chain(target.first_block);
+    } else if (hasTarget) {
+        remove_file(newparent, newname, &target, targetAddr);
+    }
+
+    struct sfs_node *node = node_begin_update(entryAddr);
+
+    if (node) {
+        entry = node->entry;
+    }
+    memset(entry.filename, 0, SFS_FILENAME_MAX);
+    strncpy(entry.filename, newname, SFS_FILENAME_MAX - 1);
+
+    if (newparent == parent) {
+        dir_rename(parent, name, &entry, entryAddr);
+    } else {
+        unsigned newAddr;
+
+        /* Added before it is removed, so a crash in between cannot lose
+         * the file. */
+        res = dir_add(newparent, &entry, &newAddr);
+        if (res == 0) {
+            if (node) {
+                node_move(node, newAddr);
+            }
+            dir_remove(parent, name, &entry, entryAddr);
+        }
+    }
+
+    if (node && res == 0) {
+        node->entry = entry;
+    }
+    node_end_update(node);
+
+    return res;
+}
+
+
+/*
+ * Move/rename the file at `path` to `newpath`.
+ * Returns 0 on succes, < 0 on error.
+ */
+static int sfs_rename(const char *path,
+                      const char *newpath)
+{
+    blockidx_t parent, newparent;
+    const char *name, *newname;
+
+    pthread_rwlock_wrlock(&ns_lock);
+
+    int res = get_parent(path, &parent, &name);
+    if (res == 0) {
+        res = get_parent(newpath, &newparent, &newname);
+    }
+    if (res == 0) {
+        res = do_rename(parent, name, newparent, newname);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+
+/*
+ * Called on every close() of a file descriptor. Writes back the write-back
+ * cache and starts writing back any data that is still in memory (with the
+ * mmap backend), without waiting for it.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void)path, (void)fi;
+
+    disk_sync(0);
+
+    return 0;
+}
+
+
+/*
+ * Make all changes so far durable on the disk image.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)path, (void)datasync, (void)fi;
+
+    disk_sync(1);
+
+    return 0;
+}
+
+
+/*
+ * Copy `size` bytes at `srcOff` of the file at `srcPath` to `dstOff` in the
+ * file open as `fi`, which must be open for writing (see copy_node). The
+ * source is resolved once, and both nodes are locked for the whole copy, in
+ * the order of their addresses so that two opposite copies cannot deadlock.
+ * The number of bytes copied is stored in ret_copied.
+ * Returns 0 on success, < 0 on error.
+ */
+static int copy_range(const char *srcPath, off_t srcOff,
+                      struct fuse_file_info *fi, off_t dstOff, size_t size,
+                      size_t *ret_copied)
+{
+    struct sfs_handle *dst = (struct sfs_handle *)(uintptr_t)fi->fh;
+    struct fuse_file_info srcFi;
+    struct sfs_handle *src;
+
+    *ret_copied = 0;
+    if (!dst || stats_snap(fi)) {
+        return -EBADF;
+    }
+    if (dst->accmode == O_RDONLY) {
+        return -EBADF;
+    }
+
+    memset(&srcFi, 0, sizeof(srcFi));
+    int res = io_handle_get(srcPath, &srcFi, &src);
+    if (res != 0) {
+        return res;
+    }
+
+    struct sfs_node *first = src->node < dst->node ? src->node : dst->node;
+    struct sfs_node *second = src->node < dst->node ? dst->node : src->node;
+
+    if (first == second) {
+        pthread_rwlock_wrlock(&first->lock);
+    } else if (first == dst->node) {
+        pthread_rwlock_wrlock(&first->lock);
+        pthread_rwlock_rdlock(&second->lock);
+    } else {
+        pthread_rwlock_rdlock(&first->lock);
+        pthread_rwlock_wrlock(&second->lock);
+    }
+
+    ssize_t copied = copy_node(dst->node, dstOff, src->node, srcOff, size);
+
+    if (first != second) {
+        pthread_rwlock_unlock(&second->lock);
+    }
+    pthread_rwlock_unlock(&first->lock);
+
+    io_handle_put(src, &srcFi);
+
+    if (copied < 0) {
+        return copied;
+    }
+    *ret_copied = copied;
+    return 0;
+}
+
+
+/*
+ * Handle an ioctl on an open file. SFS_IOC_COPY_RANGE (see sfs.h) copies data
+ * into the file within the image, for the copy_file_range that libfuse 2 does
+ * not pass on: a whole file is copied in one request (see sfscp.py).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_ioctl(const char *path, int cmd, void *arg,
+                     struct fuse_file_info *fi, unsigned int flags,
+                     void *data)
+{
+    (void)path, (void)arg, (void)flags;
+
+    if ((unsigned)cmd != SFS_IOC_COPY_RANGE) {
+        return -ENOTTY;
+    }
+
+    struct sfs_copy_range *cr = data;
+    size_t copied;
+
+    if (strnlen(cr->src_path, SFS_COPY_PATH_MAX) == SFS_COPY_PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (cr->src_offset > SFS_SIZEMASK || cr->dst_offset > SFS_SIZEMASK) {
+        return -EFBIG;
+    }
+
+    int res = copy_range(cr->src_path, cr->src_offset, fi, cr->dst_offset,
+                         cr->length, &copied);
+    cr->length = copied;
+
+    return res;
+}
+
+
+/*
+ * Negotiate the connection. fuse may move file data through pipes with splice
+ * where the kernel supports it, both for replies to low-level reads and for
+ * the data of writes (see handle_read_buf and chain_write_buf). Writes are
+ * accepted in requests of up to --max-write bytes instead of a page at a time,
+ * and with --writeback-cache the kernel may also buffer them in its page
+ * cache.
+ */
+static void conn_init(struct fuse_conn_info *conn)
+{
+    stats_start();
+    trace_start();
+
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE
+                                   | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_BIG_WRITES);
+
+    /* fuse already lowered max_write to what its buffers can take. */
+    if (options.max_write < conn->max_write) {
+        conn->max_write = options.max_write;
+    }
+
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (options.writeback_cache) {
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+#endif
+}
+
+
+static void *sfs_init(struct fuse_conn_info *conn)
+{
+    conn_init(conn);
+
+    return NULL;
+}
+
+
+/*
+ * Called on unmount: write everything back and close the image.
+ */
+static void sfs_destroy(void *private_data)
+{
+    (void)private_data;
+
+    trace_stop();
+    capture_close();
+    ra_shutdown();
+    disk_close_image();
+}
+
+
+/*
+ * Report filesystem usage (e.g., for df). Served entirely from the allocator's
+ * counters and those of the directory slots, which count as the inodes, so
+ * this never touches the disk.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_statfs(const char *path, struct statvfs *st)
+{
+    unsigned files, filesFree;
+
+    (void)path;
+    memset(st, 0, sizeof(struct statvfs));
+    dir_usage(&files, &filesFree);
+
+    st->f_bsize = SFS_BLOCK_SIZE;
+    st->f_frsize = SFS_BLOCK_SIZE;
+    st->f_blocks = SFS_BLOCKTBL_NENTRIES;
+    st->f_bfree = alloc_nfree();
+    st->f_bavail = st->f_bfree;
+    st->f_files = files;
+    st->f_ffree = filesFree;
+    st->f_favail = filesFree;
+    st->f_namemax = SFS_FILENAME_MAX - 1;
+
+    return 0;
+}
+
+
+/*
+ * Callbacks as registered with fuse: each one is counted in the statistics
+ * under `op`, traced (see op_end) and captured (see capture_add), as
+ * timed_<callback>. `path`, `offset` and `size` are what the trace and the
+ * capture record of the call; they are evaluated before the call, as it may
+ * consume a bufvec. `newpath` and `fi` are for the capture, or NULL.
+ */
+#define TIMED(op, fn, params, args, path, offset, size, newpath, fi) \
+    static int timed_##fn params \
+    { \
+        struct timespec start; \
+        off_t traceOff = (offset); \
+        size_t traceSize = (size); \
+        uint64_t captureFh = capture_fh(fi); \
+        op_stats_begin(&start); \
+        int res = fn args; \
+        unsigned long ns = op_end(op, &start, res, 0, path, traceOff, \
+                                  traceSize); \
+        if (capture_file) { \
+            capture_add(op, &start, ns, res, path, newpath, traceOff, \
+                        traceSize, captureFh, fi); \
+        } \
+        return res; \
+    }
+
+TIMED(OP_GETATTR, sfs_getattr, (const char *path, struct stat *st),
+      (path, st), path, 0, 0, NULL, NULL)
+TIMED(OP_READDIR, sfs_readdir, (const char *path, void *buf,
+      fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+      (path, buf, filler, offset, fi), path, offset, 0, NULL, fi)
+TIMED(OP_READ, sfs_read, (const char *path, char *buf, size_t size,
+      off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), path, offset, size, NULL, fi)
+TIMED(OP_MKDIR, sfs_mkdir, (const char *path, mode_t mode), (path, mode),
+      path, 0, 0, NULL, NULL)
+TIMED(OP_RMDIR, sfs_rmdir, (const char *path), (path), path, 0, 0, NULL,
+      NULL)
+TIMED(OP_UNLINK, sfs_unlink, (const char *path), (path), path, 0, 0, NULL,
+      NULL)
+TIMED(OP_CREATE, sfs_create, (const char *path, mode_t mode,
+      struct fuse_file_info *fi), (path, mode, fi), path, 0, 0, NULL, fi)
+TIMED(OP_OPEN, sfs_open, (const char *path, struct fuse_file_info *fi),
+      (path, fi), path, 0, 0, NULL, fi)
+TIMED(OP_RELEASE, sfs_release, (const char *path, struct fuse_file_info *fi),
+      (path, fi), path, 0, 0, NULL, fi)
+TIMED(OP_SETATTR, sfs_truncate, (const char *path, off_t size), (path, size),
+      path, size, 0, NULL, NULL)
+TIMED(OP_WRITE, sfs_write, (const char *path, const char *buf, size_t size,
+      off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), path, offset, size, NULL, fi)
+TIMED(OP_WRITE, sfs_write_buf, (const char *path, struct fuse_bufvec *buf,
+      off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi),
+      path, offset, fuse_buf_size(buf), NULL, fi)
+TIMED(OP_RENAME, sfs_rename, (const char *path, const char *newpath),
+      (path, newpath), path, 0, 0, newpath, NULL)
+TIMED(OP_STATFS, sfs_statfs, (const char *path, struct statvfs *st),
+      (path, st), path, 0, 0, NULL, NULL)
+TIMED(OP_FLUSH, sfs_flush, (const char *path, struct fuse_file_info *fi),
+      (path, fi), path, 0, 0, NULL, fi)
+TIMED(OP_FSYNC, sfs_fsync, (const char *path, int datasync,
+      struct fuse_file_info *fi), (path, datasync, fi), path, 0, 0, NULL, fi)
+TIMED(OP_IOCTL, sfs_ioctl, (const char *path, int cmd, void *arg,
+      struct fuse_file_info *fi, unsigned int flags, void *data),
+      (path, cmd, arg, fi, flags, data), path, 0, 0, NULL, fi)
+
+
+static const struct fuse_operations sfs_oper = {
+    .init       = sfs_init,
+    .getattr    = timed_sfs_getattr,
+    .readdir    = timed_sfs_readdir,
+    .read       = timed_sfs_read,
+    .mkdir      = timed_sfs_mkdir,
+    .rmdir      = timed_sfs_rmdir,
+    .unlink     = timed_sfs_unlink,
+    .create     = timed_sfs_create,
+    .open       = timed_sfs_open,
+    .release    = timed_sfs_release,
+    .truncate   = timed_sfs_truncate,
+    .write      = timed_sfs_write,
+    .write_buf  = timed_sfs_write_buf,
+    .rename     = timed_sfs_rename,
+    .statfs     = timed_sfs_statfs,
+    .flush      = timed_sfs_flush,
+    .fsync      = timed_sfs_fsync,
+    .ioctl      = timed_sfs_ioctl,
+    .destroy    = sfs_destroy,
+};
+
+
+/*
+ * Replay (--replay=FILE): run the calls of a capture (see capture_add) against
+ * the image through the same callbacks fuse uses, without mounting anything,
+ * and report throughput and latencies. The calls are made one at a time in
+ * the order in which they completed, either as fast as possible or, with
+ * --replay-timing, each at its original time since the start of the capture.
+ * Open files are matched up by their captured id; data written is a fixed
+ * pattern, as the capture does not keep the data itself.
+ */
+#define REPLAY_FILES_BUCKETS 256
+
+/* An open file of the replay, by the id it had in the capture. */
+struct replay_file {
+    struct replay_file *next;
+    uint64_t fh;
+    struct fuse_file_info fi;
+};
+
+struct replay_op {
+    unsigned long *ns;          /* Duration of every call */
+    size_t calls;
+    size_t alloc;
+    unsigned long errors;
+    unsigned long bytes;
+};
+
+struct replay {
+    struct replay_file *files[REPLAY_FILES_BUCKETS];
+    struct replay_op ops[SFS_NOPS];
+    char *buf;                  /* For reads and writes */
+    size_t buf_size;
+    unsigned long mismatches;   /* Results that differ from the capture */
+};
+
+
+static struct replay_file **replay_file_slot(struct replay *r, uint64_t fh)
+{
+    struct replay_file **p = &r->files[fh % REPLAY_FILES_BUCKETS];
+
+    while (*p && (*p)->fh != fh) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+
+/* The open file with captured id `fh`, or a new one if it is not known
+ * (also for fh 0, which is a call without a handle). */
+static struct fuse_file_info *replay_file_get(struct replay *r, uint64_t fh,
+                                              uint32_t flags)
+{
+    struct replay_file **p = replay_file_slot(r, fh);
+
+    if (!fh || !*p) {
+        struct replay_file *rf = calloc(1, sizeof(*rf));
+
+        if (!rf) {
+            return NULL;
+        }
+        rf->fh = fh;
+        rf->fi.flags = flags;
+        if (!fh) {
+            /* Not kept: freed by replay_file_put. */
+            return &rf->fi;
+        }
+        *p = rf;
+    }
+    return &(*p)->fi;
+}
+
+
+/* Done with `fi` for call `op`; forget it once released or if the open
+ * failed. */
+static void replay_file_put(struct replay *r, uint64_t fh,
+                            struct fuse_file_info *fi, enum sfs_op op,
+                            int res)
+{
+    struct replay_file *rf = (struct replay_file *)
+        ((char *)fi - offsetof(struct replay_file, fi));
+
+    if (fh && (op == OP_RELEASE
+               || ((op == OP_OPEN || op == OP_CREATE) && res < 0))) {
+        *replay_file_slot(r, fh) = rf->next;
+        fh = 0;
+    }
+    if (!fh) {
+        if (op != OP_RELEASE && fi->fh) {
+            sfs_oper.release("", fi);
+        }
+        free(rf);
+    }
+}
+
+
+static int replay_filler(void *buf, const char *name, const struct stat *st,
+                         off_t off)
+{
+    (void)buf;
+    (void)name;
+    (void)st;
+    (void)off;
+    return 0;
+}
+
+
+/* Make sure the I/O buffer holds `size` bytes. */
+static int replay_buf(struct replay *r, size_t size)
+{
+    if (size > r->buf_size) {
+        char *buf = realloc(r->buf, size);
+
+        if (!buf) {
+            return -ENOMEM;
+        }
+        memset(buf + r->buf_size, 0x5a, size - r->buf_size);
+        r->buf = buf;
+        r->buf_size = size;
+    }
+    return 0;
+}
+
+
+/* Make call `c`, with paths `path` and `newpath`. Returns its result. */
+static int replay_call(struct replay *r, const struct capture_rec *c,
+                       const char *path, const char *newpath)
+{
+    struct fuse_file_info *fi = NULL;
+    struct stat st;
+    struct statvfs vfs;
+    int res;
+
+    switch (c->op) {
+    case OP_READDIR: case OP_READ: case OP_WRITE: case OP_OPEN:
+    case OP_CREATE: case OP_RELEASE: case OP_FLUSH: case OP_FSYNC:
+        fi = replay_file_get(r, c->fh, c->flags);
+        if (!fi) {
+            return -ENOMEM;
+        }
+        break;
+    }
+    if ((c->op == OP_READ || c->op == OP_WRITE)
+            && (res = replay_buf(r, c->size)) != 0) {
+        replay_file_put(r, c->fh, fi, c->op, res);
+        return res;
+    }
+
+    switch (c->op) {
+    case OP_GETATTR: res = sfs_oper.getattr(path, &st); break;
+    case OP_SETATTR: res = sfs_oper.truncate(path, c->offset); break;
+    case OP_READDIR:
+        res = sfs_oper.readdir(path, NULL, replay_filler, c->offset, fi);
+        break;
+    case OP_OPEN: res = sfs_oper.open(path, fi); break;
+    case OP_CREATE: res = sfs_oper.create(path, 0644, fi); break;
+    case OP_READ:
+        res = sfs_oper.read(path, r->buf, c->size, c->offset, fi);
+        break;
+    case OP_WRITE:
+        res = sfs_oper.write(path, r->buf, c->size, c->offset, fi);
+        break;
+    case OP_FLUSH: res = sfs_oper.flush(path, fi); break;
+    case OP_RELEASE: res = sfs_oper.release(path, fi); break;
+    case OP_FSYNC: res = sfs_oper.fsync(path, 0, fi); break;
+    case OP_MKDIR: res = sfs_oper.mkdir(path, 0755); break;
+    case OP_RMDIR: res = sfs_oper.rmdir(path); break;
+    case OP_UNLINK: res = sfs_oper.unlink(path); break;
+    case OP_RENAME: res = sfs_oper.rename(path, newpath); break;
+    case OP_STATFS: res = sfs_oper.statfs(path, &vfs); break;
+    default: res = -ENOSYS; break;
+    }
+
+    if (fi) {
+        replay_file_put(r, c->fh, fi, c->op, res);
+    }
+    return res;
+}
+
+
+/* Count a call of `op` that took `ns` and returned `res`. */
+static void replay_count(struct replay_op *o, enum sfs_op op,
+                         unsigned long ns, int res)
+{
+    if (o->calls == o->alloc) {
+        size_t alloc = o->alloc ? o->alloc * 2 : 1024;
+        unsigned long *times = realloc(o->ns, alloc * sizeof(*times));
+
+        if (!times) {
+            return;
+        }
+        o->ns = times;
+        o->alloc = alloc;
+    }
+    o->ns[o->calls++] = ns;
+    if (res < 0) {
+        o->errors++;
+    } else if (op == OP_READ || op == OP_WRITE) {
+        o->bytes += res;
+    }
+}
+
+
+static int compare_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double replay_percentile(const struct replay_op *o, unsigned pct)
+{
+    size_t i = o->calls * pct / 100;
+
+    return o->ns[i < o->calls ? i : o->calls - 1] / 1000.0;
+}
+
+
+static void replay_report(struct replay *r, unsigned long calls,
+                          double elapsed)
+{
+    unsigned long bytes = 0;
+
+    for (unsigned op = 0; op < SFS_NOPS; op++) {
+        bytes += r->ops[op].bytes;
+    }
+    printf("replayed %lu calls in %.3f s: %.0f calls/s, %.1f MiB/s\n",
+           calls, elapsed, elapsed > 0 ? calls / elapsed : 0.0,
+           elapsed > 0 ? bytes / elapsed / (1 << 20) : 0.0);
+    if (r->mismatches) {
+        printf("%lu results differ from the capture\n", r->mismatches);
+    }
+
+    printf("%-10s %9s %8s %12s %10s %10s %10s\n", "op", "calls", "errors",
+           "bytes", "mean (us)", "p50 (us)", "p99 (us)");
+    for (unsigned op = 0; op < SFS_NOPS; op++) {
+        struct replay_op *o = &r->ops[op];
+        double total = 0;
+
+        if (!o->calls) {
+            continue;
+        }
+        qsort(o->ns, o->calls, sizeof(*o->ns), compare_ulong);
+        for (size_t i = 0; i < o->calls; i++) {
+            total += o->ns[i];
+        }
+        printf("%-10s %9zu %8lu %12lu %10.1f %10.1f %10.1f\n", op_names[op],
+               o->calls, o->errors, o->bytes, total / o->calls / 1000.0,
+               replay_percentile(o, 50), replay_percentile(o, 99));
+    }
+}
+
+
+/* Check the header of capture `f`: it must be from a driver with the same
+ * operations. Returns 0 if it is usable. */
+static int replay_check_header(FILE *f)
+{
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    uint32_t hdr[3];
+
+    if (fread(magic, sizeof(magic), 1, f) != 1
+            || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0
+            || fread(hdr, sizeof(hdr), 1, f) != 1) {
+        fprintf(stderr, "Not an SFS capture file\n");
+        return -1;
+    }
+    if (hdr[0] != CAPTURE_VERSION || hdr[1] != sizeof(struct capture_rec)
+            || hdr[2] != SFS_NOPS) {
+        fprintf(stderr, "Unsupported capture version %u\n", hdr[0]);
+        return -1;
+    }
+    for (unsigned i = 0; i < SFS_NOPS; i++) {
+        const char *name = op_names[i];
+        int ch;
+
+        do {
+            ch = fgetc(f);
+            if (ch != *name) {
+                fprintf(stderr, "The capture has different operations\n");
+                return -1;
+            }
+        } while (*name++);
+    }
+    return 0;
+}
+
+
+/* Replay capture `path` against the open image, and unmount it. Returns the
+ * exit status for main. */
+static int replay_main(const char *path)
+{
+    struct replay r;
+    struct capture_rec c;
+    struct timespec start, now;
+    char paths[UINT16_MAX + 2];
+    unsigned long calls = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror("Could not open capture file");
+        return 1;
+    }
+    if (replay_check_header(f) != 0) {
+        fclose(f);
+        return 1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    stats_start();
+    trace_start();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (fread(&c, sizeof(c), 1, f) == 1
+            && fread(paths, c.path_len, 1, f) == (c.path_len ? 1 : 0)) {
+        /* A rename has both paths, separated by a NUL. */
+        paths[c.path_len] = '\0';
+        paths[c.path_len + 1] = '\0';
+        const char *newpath = paths + strlen(paths) + 1;
+
+        /* The capture does not keep the arguments of an ioctl. */
+        if (c.op >= SFS_NOPS || c.op == OP_IOCTL) {
+            continue;
+        }
+        if (options.replay_timing) {
+            struct timespec due;
+            uint64_t ns = timespec_ns(&start) + c.start_ns;
+
+            due.tv_sec = ns / 1000000000ULL;
+            due.tv_nsec = ns % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+                                   NULL) == EINTR) {
+            }
+        }
+
+        struct timespec callStart;
+
+        clock_gettime(CLOCK_MONOTONIC, &callStart);
+        int res = replay_call(&r, &c, paths, newpath);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        replay_count(&r.ops[c.op], c.op,
+                     timespec_ns(&now) - timespec_ns(&callStart), res);
+        if (res != c.result) {
+            r.mismatches++;
+        }
+        calls++;
+    }
+    fclose(f);
+
+    /* Close what the capture left open, and write everything back, which
+     * counts towards the elapsed time. */
+    for (unsigned i = 0; i < REPLAY_FILES_BUCKETS; i++) {
+        while (r.files[i]) {
+            struct replay_file *rf = r.files[i];
+
+            r.files[i] = rf->next;
+            sfs_oper.release("", &rf->fi);
+            free(rf);
+        }
+    }
+    sfs_destroy(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    replay_report(&r, calls,
+                  (timespec_ns(&now) - timespec_ns(&start)) / 1e9);
+
+    for (unsigned op = 0; op < SFS_NOPS; op++) {
+        free(r.ops[op].ns);
+    }
+    free(r.buf);
+    return 0;
+}
+
+
+/*
+ * Low-level interface (--lowlevel). Instead of paths, the kernel identifies
+ * files by the inode numbers handed out by lookup, which are derived from the
+ * disk offset of the entry (see entry_ino). Resolving an inode therefore needs
+ * no path walk: its entry is read straight from the dentry cache or the disk,
+ * whatever the depth of the file, and lookup resolves one component at a time
+ * within a directory that is already known. The callbacks below share all
+ * the real work with the path-based ones above.
+ *
+ * An inode number stays valid for as long as its entry stays in its slot. The
+ * kernel may still hold on to the number of an entry that was removed, which
+ * is detected (-ENOENT) through the directory recorded for the slot (see
+ * slot_states). Once the slot is reused it has a new generation, which the
+ * kernel compares to tell the new file from the old one. Open files are not
+ * affected, as their I/O goes through the handle in fi->fh. An entry that
+ * rename moves into another directory gets a new inode number, so the kernel
+ * is told to drop its dentry for the new name and look it up again.
+ */
+
+/* Channel of the mount, for notifications to the kernel. */
+static struct fuse_chan *ll_chan;
+
+
+/* Disk offset of the entry of inode `ino` (any inode but the root). */
+static unsigned ino_entry_off(fuse_ino_t ino)
+{
+    return (ino - 2) * sizeof(struct sfs_entry) + SFS_ROOTDIR_OFF;
+}
+
+
+/*
+ * Fetch the entry of inode `ino` (not the root) into ret_entry, and its disk
+ * offset into ret_entry_off. Served from the dentry cache where possible,
+ * otherwise the entry is read from disk under its directory's lock and cached.
+ * The caller must hold ns_lock. Returns 0 on success, < 0 on error.
+ */
+static int ino_get(fuse_ino_t ino, struct sfs_entry *ret_entry,
+                   unsigned *ret_entry_off)
+{
+    if (ino < 2
+            || ino >= entry_ino(SFS_DATA_OFF
+                                + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE)) {
+        return -ENOENT;
+    }
+
+    unsigned entryOff = ino_entry_off(ino);
+
+    *ret_entry_off = entryOff;
+    if (dcache_lookup_off(entryOff, ret_entry) == 0) {
+        return 0;
+    }
+
+    blockidx_t dir = slot_dir(entryOff);
+    if (dir == SFS_BLOCKIDX_END) {
+        return -ENOENT;
+    }
+
+    pthread_rwlock_rdlock(dir_lock(dir));
+
+    unsigned gen = dcache_snapshot();
+    disk_read(ret_entry, sizeof(struct sfs_entry), entryOff);
+
+    int res = dir_entry_used(ret_entry) ? 0 : -ENOENT;
+    if (res == 0) {
+        ret_entry->filename[SFS_FILENAME_MAX - 1] = '\0';
+        dcache_fill(dir, ret_entry->filename, ret_entry, entryOff, gen);
+    }
+
+    pthread_rwlock_unlock(dir_lock(dir));
+
+    return res;
+}
+
+
+/* Directory (DIR_ROOT or its first block) of inode `ino`, stored in ret_dir.
+ * The caller must hold ns_lock. Returns 0 on success, < 0 on error. */
+static int ino_dir(fuse_ino_t ino, blockidx_t *ret_dir)
+{
+    struct sfs_entry entry;
+    unsigned entryOff;
+
+    if (ino == FUSE_ROOT_ID) {
+        *ret_dir = DIR_ROOT;
+        return 0;
+    }
+
+    int res = ino_get(ino, &entry, &entryOff);
+    if (res != 0) {
+        return res;
+    }
+    if (!(entry.size & SFS_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+
+    *ret_dir = entry.first_block;
+    return 0;
+}
+
+
+/* Open the file of inode `ino` into fi->fh, as do_open does for a name. */
+static int ino_open(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct sfs_entry entry;
+    unsigned entryOff;
+
+    if (ino == STATS_INO) {
+        return stats_open(fi);
+    }
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = ino_get(ino, &entry, &entryOff);
+    if (res == 0 && (entry.size & SFS_DIRECTORY)) {
+        res = -EISDIR;
+    }
+    if (res == 0) {
+        blockidx_t dir = slot_dir(entryOff);
+
+        /* Check again under the directory lock, so the file cannot be
+         * unlinked before the handle exists. */
+        pthread_rwlock_rdlock(dir_lock(dir));
+        disk_read(&entry, sizeof(struct sfs_entry), entryOff);
+        if (dir_entry_used(&entry)) {
+            res = handle_open(entryOff, &entry, fi);
+        } else {
+            res = -ENOENT;
+        }
+        pthread_rwlock_unlock(dir_lock(dir));
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+
+    return res;
+}
+
+
+/* Reply to `req` with error `err` (0 for success), noting it for the
+ * statistics of the request. */
+static void ll_reply_err(fuse_req_t req, int err)
+{
+    op_res = -err;
+    fuse_reply_err(req, err);
+}
+
+
+static void ll_entry_param(const struct sfs_entry *entry, unsigned entry_off,
+                           struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = entry_ino(entry_off);
+    e->generation = slot_gen(entry_off);
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.entry_timeout;
+    fill_stat(entry, entry_off, &e->attr);
+}
+
+
+/* Look up `name` in the directory of inode `parent` and reply with its entry.
+ * The caller must hold ns_lock. */
+static void ll_reply_lookup(fuse_req_t req, fuse_ino_t parent,
+                            const char *name)
+{
+    struct fuse_entry_param e;
+    struct sfs_entry entry;
+    unsigned entryOff;
+    blockidx_t dir;
+
+    int res = ino_dir(parent, &dir);
+    if (res == 0 && is_stats_name(dir, name)) {
+        memset(&e, 0, sizeof(e));
+        e.ino = STATS_INO;
+        stats_fill_stat(&e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (res == 0) {
+        pthread_rwlock_rdlock(dir_lock(dir));
+        res = dir_get(dir, name, &entry, &entryOff);
+        if (res == 0) {
+            /* Entries that were there at mount are not recorded yet. */
+            slot_set_dir(entryOff, dir);
+        }
+        pthread_rwlock_unlock(dir_lock(dir));
+    }
+
+    if (res != 0) {
+        ll_reply_err(req, -res);
+        return;
     }
 
-    return 0;
+    ll_entry_param(&entry, entryOff, &e);
+    fuse_reply_entry(req, &e);
 }
 
-/*
- * Return directory contents for `path`. This function should simply fill the
- * filenames - any additional information (e.g., whether something is a file or
- * directory) is later retrieved through getattr calls.
- * Use the function `filler` to add an entry to the directory. Use it like:
- *  filler(buf, <dirname>, NULL, 0);
- * Return 0 on success, < 0 on error.
- */
-static int sfs_readdir(const char *path,
-                       void *buf,
-                       fuse_fill_dir_t filler,
-                       off_t offset,
-                       struct fuse_file_info *fi)
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    (void)offset, (void)fi;
-    log("readdir %s\n", path);
+    pthread_rwlock_rdlock(&ns_lock);
+    ll_reply_lookup(req, parent, name);
+    pthread_rwlock_unlock(&ns_lock);
+}
 
-    (void)filler;
-    (void)buf;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                          unsigned long nlookup)
+{
+    (void)ino, (void)nlookup;
 
-    struct sfs_entry dirEntry;
-    unsigned int startOffDisk = 0;
-    int nEntries = 0;
+    /* The state of every slot is kept whether the kernel knows its inode
+     * number or not, so there is nothing to release. */
+    fuse_reply_none(req);
+}
 
-    if (strcmp(path, "/") == 0) {
-        startOffDisk = SFS_ROOTDIR_OFF;
-        nEntries = SFS_ROOTDIR_NENTRIES;
-        
-        for (int i = 0; i < nEntries; i++) {
-             struct sfs_entry entry;
-             disk_read(&entry, sizeof(struct sfs_entry), startOffDisk + i * sizeof(struct sfs_entry));
-             
-             if (strlen(entry.filename) != 0) {
-                 filler(buf, entry.filename, NULL, 0);
-             }
+
+/* Reply with the attributes of inode `ino`. An open file's node has the latest
+ * entry, even if it was unlinked since. */
+static void ll_reply_attr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+    struct sfs_handle *h = fi ? (struct sfs_handle *)(uintptr_t)fi->fh : NULL;
+    struct sfs_entry entry;
+    unsigned entryOff;
+    struct stat st;
+    int res = 0;
+
+    if (ino == FUSE_ROOT_ID || ino == STATS_INO) {
+        if (ino == FUSE_ROOT_ID) {
+            fill_stat(NULL, 0, &st);
+        } else {
+            stats_fill_stat(&st);
         }
+        fuse_reply_attr(req, &st, options.attr_timeout);
+        return;
+    }
 
+    if (h) {
+        pthread_rwlock_rdlock(&h->node->lock);
+        entry = h->node->entry;
+        entryOff = h->node->entry_off;
+        pthread_rwlock_unlock(&h->node->lock);
     } else {
+        pthread_rwlock_rdlock(&ns_lock);
+        res = ino_get(ino, &entry, &entryOff);
+        pthread_rwlock_unlock(&ns_lock);
+    }
 
-        int res = get_entry(path, &dirEntry, NULL);
+    if (res != 0) {
+        ll_reply_err(req, -res);
+        return;
+    }
 
-        if (res != 0) {
-            return res;
-        }
+    fill_stat(&entry, entryOff, &st);
+    fuse_reply_attr(req, &st, options.attr_timeout);
+}
 
-        blockidx_t blk = dirEntry.first_block;
-        
-        while (blk != SFS_BLOCKIDX_END && blk != SFS_BLOCKIDX_EMPTY) {
-            
-            for (int i=0; i < 8; i++) {
 
-                struct sfs_entry entry;
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+    ll_reply_attr(req, ino, fi);
+}
 
-                off_t addr = SFS_DATA_OFF + (blk * SFS_BLOCK_SIZE) + (i * sizeof(struct sfs_entry));
-                
-                disk_read(&entry, sizeof(struct sfs_entry), addr);
 
-                if (strlen(entry.filename) != 0) {
-                    filler(buf, entry.filename, NULL, 0);
-                }
+/* Only the size can be changed; everything else is fixed in SFS, so other
+ * changes are accepted but have no effect. */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi)
+{
+    if (ino == STATS_INO && (to_set & FUSE_SET_ATTR_SIZE)) {
+        ll_reply_err(req, EACCES);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        struct fuse_file_info tmp;
+        struct sfs_handle *h = fi ? (struct sfs_handle *)(uintptr_t)fi->fh
+                                  : NULL;
+
+        memset(&tmp, 0, sizeof(tmp));
+        if (!h) {
+            int res = ino_open(ino, &tmp);
+            if (res != 0) {
+                ll_reply_err(req, -res);
+                return;
             }
-            blk = get_next(blk);
+            h = (struct sfs_handle *)(uintptr_t)tmp.fh;
+        }
+
+        pthread_rwlock_wrlock(&h->node->lock);
+        int res = truncate_node(h->node, attr->st_size);
+        pthread_rwlock_unlock(&h->node->lock);
+
+        if (h == (struct sfs_handle *)(uintptr_t)tmp.fh) {
+            handle_close(h);
+        }
+        if (res != 0) {
+            ll_reply_err(req, -res);
+            return;
         }
     }
 
-    return 0;
+    ll_reply_attr(req, ino, fi);
 }
 
-/*
- * Read contents of `path` into `buf` for  up to `size` bytes.
- * Note that `size` may be bigger than the file actually is.
- * Reading should start at offset `offset`; the OS will generally read your file
- * in chunks of 4K byte.
- * Returns the number of bytes read (writting into `buf`), or < 0 on error.
- */
-static int sfs_read(const char *path, char *buf, size_t size, off_t offset,
-                    struct fuse_file_info *fi)
-{
-    (void)fi;
-    log("read %s size=%zu offset=%ld\n", path, size, offset);
 
-    struct sfs_entry entry;
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode)
+{
+    (void)mode;
 
-    if (get_entry(path, &entry, NULL) != 0){
-        return -ENOENT;
-    }
+    blockidx_t dir;
 
-    blockidx_t blk = entry.first_block;
-    size_t bytesRead = 0;
+    pthread_rwlock_rdlock(&ns_lock);
 
-    while (offset >= SFS_BLOCK_SIZE) {
-        blk = get_next(blk);
-        offset -= SFS_BLOCK_SIZE;
+    int res = ino_dir(parent, &dir);
+    if (res == 0) {
+        res = do_mkdir(dir, name);
     }
 
-    while (bytesRead < size && blk != SFS_BLOCKIDX_END && blk != SFS_BLOCKIDX_EMPTY) {
-        
-        size_t needRead = SFS_BLOCK_SIZE - offset;
-
-        off_t addr = SFS_DATA_OFF + (blk * SFS_BLOCK_SIZE) + offset;
-        disk_read(buf + bytesRead, needRead, addr);
-
-        bytesRead += needRead;
-        offset = 0;
-        blk = get_next(blk);
+    /* ns_lock is still held, so the directory cannot be gone already. */
+    if (res == 0) {
+        ll_reply_lookup(req, parent, name);
+    } else {
+        ll_reply_err(req, -res);
     }
 
-    return bytesRead;
+    pthread_rwlock_unlock(&ns_lock);
 }
 
-/*
- * Create directory at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_mkdir(const char *path, mode_t mode)
+
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    log("mkdir %s\n", path);
-    (void)mode;
-    
-    char *copy = strdup(path);
-    
-    char *endSlh = strrchr(copy, '/');    
-    *endSlh = '\0';
+    blockidx_t dir;
 
-    char *pPath = copy;
-    
-    if (strlen(pPath) == 0){
-        pPath = "/";
+    pthread_rwlock_rdlock(&ns_lock);
+
+    int res = ino_dir(parent, &dir);
+    if (res == 0) {
+        res = do_unlink(dir, name);
     }
 
-    struct sfs_entry pEntry;
-    unsigned int pDiskOff = 0;
+    pthread_rwlock_unlock(&ns_lock);
 
-    int isRoot = (strcmp(pPath, "/") == 0);
+    ll_reply_err(req, -res);
+}
 
-    if (!isRoot) {
-        if (get_entry(pPath, &pEntry, &pDiskOff) != 0) {
-            return -ENOENT;
-        }
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    blockidx_t dir;
+
+    pthread_rwlock_wrlock(&ns_lock);
+
+    int res = ino_dir(parent, &dir);
+    if (res == 0) {
+        res = do_rmdir(dir, name);
     }
 
-    blockidx_t pBlk = isRoot ? 0 : pEntry.first_block;
-    
-    unsigned int emptySlotAddr = 0;
-    int foundSlot = 0;
-    int entriesChecked = 0;
-
-    int maxEntry = isRoot ? SFS_ROOTDIR_NENTRIES : SFS_DIR_NENTRIES;
-
-    while(entriesChecked < maxEntry) {
-        
-        for(int i=0; i<8; i++) {
-            
-            off_t addr;
-
-            if (isRoot) {
-                addr = SFS_ROOTDIR_OFF + (entriesChecked * sizeof(struct sfs_entry));
-            } else {
-                addr = SFS_DATA_OFF + (pBlk * SFS_BLOCK_SIZE) + (i * sizeof(struct sfs_entry));
-            }
+    pthread_rwlock_unlock(&ns_lock);
 
-            struct sfs_entry temp;
-            disk_read(&temp, sizeof(struct sfs_entry), addr);
-            
-            if (strlen(temp.filename) == 0 && foundSlot == 0) {
-                emptySlotAddr = addr;
-                foundSlot = 1;
-            }
+    ll_reply_err(req, -res);
+}
 
-            entriesChecked++;
-        }
 
-        pBlk = get_next(pBlk);
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          fuse_ino_t newparent, const char *newname)
+{
+    blockidx_t dir, newdir;
+
+    pthread_rwlock_wrlock(&ns_lock);
 
-        if (pBlk == SFS_BLOCKIDX_END){
-            break;
-        }
+    int res = ino_dir(parent, &dir);
+    if (res == 0) {
+        res = ino_dir(newparent, &newdir);
+    }
+    if (res == 0) {
+        res = do_rename(dir, name, newdir, newname);
     }
 
-    blockidx_t b1 = free_blk();
-    
-    set_next(b1, SFS_BLOCKIDX_END); 
-    
-    blockidx_t b2 = free_blk();
+    pthread_rwlock_unlock(&ns_lock);
 
-    set_next(b1, b2);
-    set_next(b2, SFS_BLOCKIDX_END);
+    ll_reply_err(req, -res);
 
-    struct sfs_entry newEntry;
+    /* The kernel moved its dentry to the new name, but it still refers to
+     * the old inode number. Only sent after the reply, as the kernel holds
+     * the directories locked until then. */
+    if (res == 0 && newdir != dir && ll_chan) {
+        fuse_lowlevel_notify_inval_entry(ll_chan, newparent, newname,
+                                         strlen(newname));
+    }
+}
 
-    memset(&newEntry, 0, sizeof(struct sfs_entry));
-    
-    char *newName = endSlh + 1;
-    strncpy(newEntry.filename, newName, SFS_FILENAME_MAX - 1);
 
-    newEntry.first_block = b1;
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, struct fuse_file_info *fi)
+{
+    (void)mode;
 
-    newEntry.size = SFS_DIRECTORY;
+    blockidx_t dir;
 
-    disk_write(&newEntry, sizeof(struct sfs_entry), emptySlotAddr);
-    
-    struct sfs_entry emptyEntries[8];
+    pthread_rwlock_rdlock(&ns_lock);
 
-    memset(emptyEntries, 0, sizeof(emptyEntries));
+    int res = ino_dir(parent, &dir);
+    if (res == 0) {
+        res = do_create(dir, name, fi);
+    }
 
-    for(int i=0; i<8; i++) {
-        emptyEntries[i].first_block = SFS_BLOCKIDX_EMPTY;
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (res != 0) {
+        ll_reply_err(req, -res);
+        return;
     }
 
-    disk_write(emptyEntries, SFS_BLOCK_SIZE, SFS_DATA_OFF + (b1 * SFS_BLOCK_SIZE));
-    disk_write(emptyEntries, SFS_BLOCK_SIZE, SFS_DATA_OFF + (b2 * SFS_BLOCK_SIZE));
+    struct sfs_handle *h = (struct sfs_handle *)(uintptr_t)fi->fh;
+    struct fuse_entry_param e;
 
-    return 0;
+    pthread_rwlock_rdlock(&h->node->lock);
+    ll_entry_param(&h->node->entry, h->node->entry_off, &e);
+    pthread_rwlock_unlock(&h->node->lock);
+
+    if (fuse_reply_create(req, &e, fi) != 0) {
+        /* The request was interrupted, so there will be no release. */
+        handle_close(h);
+    }
 }
 
-/*
- * Remove directory at `path`.
- * Directories may only be removed if they are empty, otherwise this function
- * should return -ENOTEMPTY.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_rmdir(const char *path)
-{
-    log("rmdir %s\n", path);
 
-    struct sfs_entry entry;
-    unsigned int entryAddr;
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    int res = ino_open(ino, fi);
 
-    if (get_entry(path, &entry, &entryAddr) != 0){
-        return -ENOENT;
+    if (res != 0) {
+        ll_reply_err(req, -res);
+    } else if (fuse_reply_open(req, fi) != 0) {
+        sfs_release("", fi);
     }
+}
 
-    blockidx_t blk = entry.first_block;
 
-    while(blk != SFS_BLOCKIDX_END && blk != SFS_BLOCKIDX_EMPTY) {
-        
-        for(int i=0; i<8; i++) {
+/* Read with handle_read_buf, and reply while the node is still locked, so
+ * the segments are spliced before the blocks can change. */
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    (void)ino;
 
-            struct sfs_entry temp;
+    struct sfs_handle *h = (struct sfs_handle *)(uintptr_t)fi->fh;
+    struct fuse_bufvec *buf;
 
-            disk_read(&temp, sizeof(struct sfs_entry), SFS_DATA_OFF + (blk * SFS_BLOCK_SIZE) + (i*sizeof(struct sfs_entry)));
-            
-            if (strlen(temp.filename) > 0){
-                return -ENOTEMPTY;
-            }
+    if (stats_snap(fi)) {
+        char *data = malloc(size ? size : 1);
+
+        if (!data) {
+            ll_reply_err(req, ENOMEM);
+            return;
         }
-        blk = get_next(blk);
+        op_res = stats_read(stats_snap(fi), data, size, offset);
+        fuse_reply_buf(req, data, op_res);
+        free(data);
+        return;
     }
 
-    blk = entry.first_block;
+    pthread_rwlock_rdlock(&h->node->lock);
 
-    while(blk != SFS_BLOCKIDX_END && blk != SFS_BLOCKIDX_EMPTY) {
+    int res = handle_read_buf(h, size, offset, &buf);
 
-        blockidx_t next = get_next(blk);
-        set_next(blk, SFS_BLOCKIDX_EMPTY);
-
-        blk = next;
+    if (res < 0) {
+        ll_reply_err(req, -res);
+    } else {
+        op_res = fuse_buf_size(buf);
+        fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+        bufvec_free(buf);
     }
 
-    struct sfs_entry emptyEntry;
+    pthread_rwlock_unlock(&h->node->lock);
+}
+
 
-    memset(&emptyEntry, 0, sizeof(struct sfs_entry));
+static void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_bufvec *bufv, off_t offset,
+                             struct fuse_file_info *fi)
+{
+    (void)ino;
 
-    emptyEntry.first_block = SFS_BLOCKIDX_EMPTY;
-    
-    disk_write(&emptyEntry, sizeof(struct sfs_entry), entryAddr);
+    struct sfs_handle *h = (struct sfs_handle *)(uintptr_t)fi->fh;
+    int res = handle_write(h, bufv, offset);
 
-    return 0;
+    if (res < 0) {
+        ll_reply_err(req, -res);
+    } else {
+        op_res = res;
+        fuse_reply_write(req, res);
+    }
 }
 
-/*
- * Remove file at `path`.
- * Can not be used to remove directories.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_unlink(const char *path)
+
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
 {
-    log("unlink %s\n", path);
+    (void)ino;
+    ll_reply_err(req, -sfs_flush("", fi));
+}
 
-    struct sfs_entry entry;
-    unsigned int entryAddr;
 
-    if (get_entry(path, &entry, &entryAddr) != 0){
-        return -ENOENT;
-    }
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+    (void)ino;
+    ll_reply_err(req, -sfs_release("", fi));
+}
 
-    blockidx_t blk = entry.first_block;
 
-    while(blk != SFS_BLOCKIDX_END && blk != SFS_BLOCKIDX_EMPTY) {
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi)
+{
+    (void)ino;
+    ll_reply_err(req, -sfs_fsync("", datasync, fi));
+}
 
-        blockidx_t next = get_next(blk);
-        set_next(blk, SFS_BLOCKIDX_EMPTY);
 
-        blk = next;
+static void sfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                         struct fuse_file_info *fi, unsigned flags,
+                         const void *in_buf, size_t in_bufsz,
+                         size_t out_bufsz)
+{
+    struct sfs_copy_range cr;
+
+    if ((unsigned)cmd != SFS_IOC_COPY_RANGE) {
+        ll_reply_err(req, ENOTTY);
+        return;
+    }
+    if (in_bufsz < sizeof(cr) || out_bufsz < sizeof(cr)) {
+        ll_reply_err(req, EINVAL);
+        return;
     }
 
-    struct sfs_entry empty;
+    memcpy(&cr, in_buf, sizeof(cr));
+    int res = sfs_ioctl("", cmd, arg, fi, flags, &cr);
+    if (res < 0) {
+        ll_reply_err(req, -res);
+        return;
+    }
 
-    memset(&empty, 0, sizeof(struct sfs_entry));
+    op_res = cr.length;
+    fuse_reply_ioctl(req, 0, &cr, sizeof(cr));
 
-    empty.first_block = SFS_BLOCKIDX_EMPTY;
+    /* The kernel may have cached pages and the size of the destination,
+     * which the copy changed behind its back. */
+    if (cr.length && ll_chan) {
+        fuse_lowlevel_notify_inval_inode(ll_chan, ino, 0, 0);
+    }
+}
 
-    disk_write(&empty, sizeof(struct sfs_entry), entryAddr);
 
-    return 0;
+/* Add `name` to a readdir reply in `buf`, which holds `used` of `size` bytes.
+ * Returns the new number of bytes used, or 0 if the entry does not fit. */
+static size_t ll_add_dirent(fuse_req_t req, char *buf, size_t used,
+                            size_t size, const char *name,
+                            const struct stat *st, off_t next)
+{
+    size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+    if (used + len > size) {
+        return 0;
+    }
+    fuse_add_direntry(req, buf + used, size - used, name, st, next);
+    return used + len;
 }
 
+
 /*
- * Create an empty file at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
+ * List the directory of inode `ino`. Directory offsets are slot numbers (after
+ * "." and ".."), so a listing that needs several calls resumes at the right
+ * entry even if entries are added or removed in between. As with sfs_readdir,
+ * all entries returned are added to the dentry cache.
  */
-static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
 {
-    (void)fi; 
-    (void)mode;
-    
-    log("create %s\n", path);
+    (void)fi;
 
-    char *copy = strdup(path);
+    struct sfs_dir d;
+    blockidx_t dir;
 
-    char *endSlh = strrchr(copy, '/');
-    *endSlh = '\0';
-    
-    char *pPath = copy;
-    
-    if (strlen(pPath) == 0){
-        pPath = "/";
-    }
+    pthread_rwlock_rdlock(&ns_lock);
 
-    struct sfs_entry pEntry;
+    int res = ino_dir(ino, &dir);
+    if (res != 0) {
+        pthread_rwlock_unlock(&ns_lock);
+        ll_reply_err(req, -res);
+        return;
+    }
 
-    int isRoot = (strcmp(pPath, "/") == 0);
+    char *buf = malloc(size);
+    size_t used = 0;
 
-    if (!isRoot) {
-        if (get_entry(pPath, &pEntry, NULL) != 0) { 
-            return -ENOENT; 
-        }
+    if (!buf) {
+        pthread_rwlock_unlock(&ns_lock);
+        ll_reply_err(req, ENOMEM);
+        return;
     }
 
-    blockidx_t pBlk = isRoot ? 0 : pEntry.first_block;
-
-    unsigned int emptySlot = 0;
-    int found = 0;
-    int checked = 0;
-    int maxEntry = isRoot ? SFS_ROOTDIR_NENTRIES : SFS_DIR_NENTRIES;
+    pthread_rwlock_rdlock(dir_lock(dir));
 
-    while(checked < maxEntry) {
+    unsigned gen = dcache_snapshot();
+    dir_load(dir, &d);
 
-        for(int i=0; i<8; i++) {
+    for (off_t i = offset; i < (off_t)d.nentries + 2; i++) {
+        const char *name = i == 0 ? "." : "..";
+        struct stat st;
+        size_t n;
 
-             off_t addr = isRoot ? (SFS_ROOTDIR_OFF + checked * sizeof(struct sfs_entry)) : (SFS_DATA_OFF + pBlk * SFS_BLOCK_SIZE + i * sizeof(struct sfs_entry));
-             struct sfs_entry temp;
-             
-             disk_read(&temp, sizeof(temp), addr);
+        memset(&st, 0, sizeof(struct stat));
+        st.st_mode = S_IFDIR;
 
-             if (strlen(temp.filename) == 0 && !found) {
-                 emptySlot = addr;
-                 found = 1;
-             }
+        if (i >= 2) {
+            const struct sfs_entry *entry = &d.entries[i - 2];
+            unsigned entryOff = dir_entry_off(&d, i - 2);
 
-             checked++;
+            if (!dir_entry_used(entry)) {
+                continue;
+            }
+            fill_stat(entry, entryOff, &st);
+            dcache_fill(dir, entry->filename, entry, entryOff, gen);
+            name = entry->filename;
         }
 
-        pBlk = get_next(pBlk);
-
-        if (pBlk == SFS_BLOCKIDX_END){
+        n = ll_add_dirent(req, buf, used, size, name, &st, i + 1);
+        if (n == 0) {
             break;
         }
+        used = n;
     }
 
-    struct sfs_entry newFile;
-
-    memset(&newFile, 0, sizeof(newFile));
-
-    char *newName = endSlh + 1;
+    pthread_rwlock_unlock(dir_lock(dir));
+    pthread_rwlock_unlock(&ns_lock);
 
-    if (strlen(newName) > SFS_FILENAME_MAX - 1) { 
-        return -ENAMETOOLONG; 
-    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
 
-    strncpy(newFile.filename, newName, SFS_FILENAME_MAX - 1);
 
-    newFile.first_block = SFS_BLOCKIDX_END;
-    newFile.size = 0;
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
 
-    disk_write(&newFile, sizeof(newFile), emptySlot);
-    return 0;
+    conn_init(conn);
 }
 
 
-/*
- * Shrink or grow the file at `path` to `size` bytes.
- * Excess bytes are thrown away, whereas any bytes added in the process should
- * be nil (\0).
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_truncate(const char *path, off_t size)
+static void sfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-    log("truncate %s size=%ld\n", path, size);
+    struct statvfs st;
 
-    return -ENOSYS;
+    (void)ino;
+    sfs_statfs("/", &st);
+    fuse_reply_statfs(req, &st);
 }
 
 
-/*
- * Write contents of `buf` (of `size` bytes) to the file at `path`.
- * The file is grown if nessecary, and any bytes already present are overwritten
- * (whereas any other data is left intact). The `offset` argument specifies how
- * many bytes should be skipped in the file, after which `size` bytes from
- * buffer are written.
- * This means that the new file size will be max(old_size, offset + size).
- * Returns the number of bytes written, or < 0 on error.
- */
-static int sfs_write(const char *path,
-                     const char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi)
-{
-    (void)fi;
-    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
-        size, offset);
+/* As TIMED, for the low-level callbacks, which report their result in
+ * op_res. Calls on a name in a directory are traced by the name and the
+ * directory's inode, other calls by their inode. */
+#define LL_TIMED(op, fn, params, args, ino, name, offset, size) \
+    static void timed_##fn params \
+    { \
+        struct timespec start; \
+        off_t traceOff = (offset); \
+        size_t traceSize = (size); \
+        op_res = 0; \
+        op_stats_begin(&start); \
+        fn args; \
+        op_end(op, &start, op_res, ino, name, traceOff, traceSize); \
+    }
 
-    return -ENOSYS;
-}
+LL_TIMED(OP_LOOKUP, sfs_ll_lookup, (fuse_req_t req, fuse_ino_t parent,
+         const char *name), (req, parent, name), parent, name, 0, 0)
+LL_TIMED(OP_GETATTR, sfs_ll_getattr, (fuse_req_t req, fuse_ino_t ino,
+         struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+LL_TIMED(OP_SETATTR, sfs_ll_setattr, (fuse_req_t req, fuse_ino_t ino,
+         struct stat *attr, int to_set, struct fuse_file_info *fi),
+         (req, ino, attr, to_set, fi), ino, NULL,
+         to_set & FUSE_SET_ATTR_SIZE ? attr->st_size : 0, 0)
+LL_TIMED(OP_MKDIR, sfs_ll_mkdir, (fuse_req_t req, fuse_ino_t parent,
+         const char *name, mode_t mode), (req, parent, name, mode),
+         parent, name, 0, 0)
+LL_TIMED(OP_UNLINK, sfs_ll_unlink, (fuse_req_t req, fuse_ino_t parent,
+         const char *name), (req, parent, name), parent, name, 0, 0)
+LL_TIMED(OP_RMDIR, sfs_ll_rmdir, (fuse_req_t req, fuse_ino_t parent,
+         const char *name), (req, parent, name), parent, name, 0, 0)
+LL_TIMED(OP_RENAME, sfs_ll_rename, (fuse_req_t req, fuse_ino_t parent,
+         const char *name, fuse_ino_t newparent, const char *newname),
+         (req, parent, name, newparent, newname), parent, name, 0, 0)
+LL_TIMED(OP_OPEN, sfs_ll_open, (fuse_req_t req, fuse_ino_t ino,
+         struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+LL_TIMED(OP_READ, sfs_ll_read, (fuse_req_t req, fuse_ino_t ino, size_t size,
+         off_t offset, struct fuse_file_info *fi),
+         (req, ino, size, offset, fi), ino, NULL, offset, size)
+LL_TIMED(OP_WRITE, sfs_ll_write_buf, (fuse_req_t req, fuse_ino_t ino,
+         struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi),
+         (req, ino, bufv, offset, fi), ino, NULL, offset, fuse_buf_size(bufv))
+LL_TIMED(OP_FLUSH, sfs_ll_flush, (fuse_req_t req, fuse_ino_t ino,
+         struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+LL_TIMED(OP_RELEASE, sfs_ll_release, (fuse_req_t req, fuse_ino_t ino,
+         struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+LL_TIMED(OP_FSYNC, sfs_ll_fsync, (fuse_req_t req, fuse_ino_t ino,
+         int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi),
+         ino, NULL, 0, 0)
+LL_TIMED(OP_READDIR, sfs_ll_readdir, (fuse_req_t req, fuse_ino_t ino,
+         size_t size, off_t offset, struct fuse_file_info *fi),
+         (req, ino, size, offset, fi), ino, NULL, offset, size)
+LL_TIMED(OP_STATFS, sfs_ll_statfs, (fuse_req_t req, fuse_ino_t ino),
+         (req, ino), ino, NULL, 0, 0)
+LL_TIMED(OP_CREATE, sfs_ll_create, (fuse_req_t req, fuse_ino_t parent,
+         const char *name, mode_t mode, struct fuse_file_info *fi),
+         (req, parent, name, mode, fi), parent, name, 0, 0)
+LL_TIMED(OP_IOCTL, sfs_ll_ioctl, (fuse_req_t req, fuse_ino_t ino, int cmd,
+         void *arg, struct fuse_file_info *fi, unsigned flags,
+         const void *in_buf, size_t in_bufsz, size_t out_bufsz),
+         (req, ino, cmd, arg, fi, flags, in_buf, in_bufsz, out_bufsz), ino,
+         NULL, 0, 0)
+
+
+static const struct fuse_lowlevel_ops sfs_ll_oper = {
+    .init       = sfs_ll_init,
+    .destroy    = sfs_destroy,
+    .lookup     = timed_sfs_ll_lookup,
+    .forget     = sfs_ll_forget,
+    .getattr    = timed_sfs_ll_getattr,
+    .setattr    = timed_sfs_ll_setattr,
+    .mkdir      = timed_sfs_ll_mkdir,
+    .unlink     = timed_sfs_ll_unlink,
+    .rmdir      = timed_sfs_ll_rmdir,
+    .rename     = timed_sfs_ll_rename,
+    .open       = timed_sfs_ll_open,
+    .read       = timed_sfs_ll_read,
+    .write_buf  = timed_sfs_ll_write_buf,
+    .flush      = timed_sfs_ll_flush,
+    .release    = timed_sfs_ll_release,
+    .fsync      = timed_sfs_ll_fsync,
+    .readdir    = timed_sfs_ll_readdir,
+    .statfs     = timed_sfs_ll_statfs,
+    .create     = timed_sfs_ll_create,
+    .ioctl      = timed_sfs_ll_ioctl,
+};
 
 
-/*
- * Move/rename the file at `path` to `newpath`.
- * Returns 0 on succes, < 0 on error.
- */
-static int sfs_rename(const char *path,
-                      const char *newpath)
+/* Mount and serve requests through the low-level interface, as fuse_main does
+ * for the path-based one. */
+static int ll_main(struct fuse_args *args)
 {
-    /* Implementing this function is optional, and not worth any points. */
-    log("rename %s %s\n", path, newpath);
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint = NULL;
+    int multithreaded = 0, foreground = 0;
+    int err = -1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1) {
+        return 1;
+    }
 
-    return -ENOSYS;
-}
+    if (slot_init() != 0) {
+        fprintf(stderr, "Out of memory\n");
+        free(mountpoint);
+        return 1;
+    }
+
+    ch = fuse_mount(mountpoint, args);
+    ll_chan = ch;
+    if (ch) {
+        se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), NULL);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) != -1) {
+                    err = multithreaded ? fuse_session_loop_mt(se)
+                                        : fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
 
+    free(mountpoint);
+    fuse_opt_free_args(args);
 
-static const struct fuse_operations sfs_oper = {
-    .getattr    = sfs_getattr,
-    .readdir    = sfs_readdir,
-    .read       = sfs_read,
-    .mkdir      = sfs_mkdir,
-    .rmdir      = sfs_rmdir,
-    .unlink     = sfs_unlink,
-    .create     = sfs_create,
-    .truncate   = sfs_truncate,
-    .write      = sfs_write,
-    .rename     = sfs_rename,
-};
+    return err ? 1 : 0;
+}
 
 
 #define OPTION(t, p)                            \
@@ -673,6 +5310,22 @@ static const struct fuse_operations sfs_oper = {
     OPTION(l, p)
 static const struct fuse_opt option_spec[] = {
     LOPTION("-i %s",    "--img=%s",     img),
+    OPTION(             "--io=%s",      io),
+    OPTION(             "--cache-mb=%u", cache_mb),
+    OPTION(             "--writeback",  writeback),
+    OPTION(             "--attr-timeout=%lf", attr_timeout),
+    OPTION(             "--entry-timeout=%lf", entry_timeout),
+    OPTION(             "--kernel-cache", kernel_cache),
+    { "--no-kernel-cache", offsetof(struct options, kernel_cache), 0 },
+    OPTION(             "--max-write=%u", max_write),
+    OPTION(             "--max-read=%u", max_read),
+    OPTION(             "--writeback-cache", writeback_cache),
+    OPTION(             "--stats=%s",   stats),
+    OPTION(             "--trace=%s",   trace),
+    OPTION(             "--capture=%s", capture),
+    OPTION(             "--replay=%s",  replay),
+    OPTION(             "--replay-timing", replay_timing),
+    OPTION(             "--lowlevel",   lowlevel),
     LOPTION("-b",       "--background", background),
     LOPTION("-v",       "--verbose",    verbose),
     LOPTION("-h",       "--help",       show_help),
@@ -682,7 +5335,9 @@ static const struct fuse_opt option_spec[] = {
 
 static void show_help(const char *progname)
 {
-    printf("usage: %s mountpoint [options]\n\n", progname);
+    printf("usage: %s mountpoint [options]\n"
+           "       %s --replay=FILE [-i IMAGE] [options]\n\n", progname,
+           progname);
     printf("By default this FUSE runs in the foreground, and will unmount on\n"
            "exit. If something goes wrong and FUSE does not exit cleanly, use\n"
            "the following command to unmount your mountpoint:\n"
@@ -690,11 +5345,45 @@ static void show_help(const char *progname)
     printf("common options (use --fuse-help for all options):\n"
            "    -i, --img=FILE      filename of SFS image to mount\n"
            "                        (default: \"%s\")\n"
+           "        --io=BACKEND    how to access the image: \"pread\" or\n"
+           "                        \"mmap\" (default: \"pread\")\n"
+           "        --cache-mb=N    size of the block cache in MiB, 0 to\n"
+           "                        disable it (default: %u)\n"
+           "        --writeback     keep written blocks in the cache and\n"
+           "                        write them back on fsync, close, unmount\n"
+           "                        and every few seconds\n"
+           "        --lowlevel      use the inode-based FUSE interface, which\n"
+           "                        also splices reads from the image\n"
+           "        --attr-timeout=S, --entry-timeout=S\n"
+           "                        seconds the kernel may cache attributes\n"
+           "                        and lookups (default: %g)\n"
+           "        --[no-]kernel-cache\n"
+           "                        keep file data cached in the kernel\n"
+           "                        across opens (default: on)\n"
+           "        --max-write=N, --max-read=N\n"
+           "                        largest write and read requests in bytes\n"
+           "                        (default and libfuse maximum: %u)\n"
+           "        --writeback-cache\n"
+           "                        let the kernel buffer writes in its page\n"
+           "                        cache, if libfuse supports it\n"
+           "        --stats=FILE    write statistics to FILE as JSON on SIGUSR1,\n"
+           "                        instead of to stderr. They can also be\n"
+           "                        read from /" STATS_NAME " in the mount\n"
+           "        --trace=FILE    write a binary trace of every request to\n"
+           "                        FILE (decode it with trace.py)\n"
+           "        --capture=FILE  record every request to FILE, for\n"
+           "                        --replay (path-based interface only)\n"
+           "        --replay=FILE   run the requests recorded in FILE against\n"
+           "                        the image, without mounting, and report\n"
+           "                        throughput and latencies\n"
+           "        --replay-timing replay each request at its recorded time\n"
+           "                        instead of as fast as possible\n"
            "    -b, --background    run fuse in background\n"
-           "    -v, --verbose       print debug information\n"
+           "    -v, --verbose       print a trace of every request\n"
            "    -h, --help          show this summarized help\n"
            "        --fuse-help     show full FUSE help\n"
-           "\n", default_img);
+           "\n", default_img, DEFAULT_CACHE_MB, DEFAULT_TIMEOUT,
+           DEFAULT_MAX_IO);
 }
 
 int main(int argc, char **argv)
@@ -702,6 +5391,12 @@ int main(int argc, char **argv)
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     options.img = strdup(default_img);
+    options.cache_mb = DEFAULT_CACHE_MB;
+    options.attr_timeout = DEFAULT_TIMEOUT;
+    options.entry_timeout = DEFAULT_TIMEOUT;
+    options.kernel_cache = 1;
+    options.max_write = DEFAULT_MAX_IO;
+    options.max_read = DEFAULT_MAX_IO;
 
     fuse_opt_parse(&args, &options, option_spec, NULL);
 
@@ -718,7 +5413,71 @@ int main(int argc, char **argv)
     if (!options.background)
         assert(fuse_opt_add_arg(&args, "-f") == 0);
 
+    /* The image is owned exclusively by this driver, so the kernel can safely
+     * cache attributes and lookups for a while: every change but the in-driver
+     * copy passes through it, and it updates its own caches for them (for the
+     * copy, see SFS_IOC_COPY_RANGE in sfs.h). use_ino makes it use the inode
+     * numbers from fill_stat. The low-level interface sets the timeouts in
+     * every reply instead. These go first so that options given on the
+     * commandline take precedence. */
+    char mountOpts[128];
+
+    if (options.lowlevel) {
+        snprintf(mountOpts, sizeof(mountOpts), "-omax_read=%u",
+                 options.max_read);
+    } else {
+        snprintf(mountOpts, sizeof(mountOpts),
+                 "-oattr_timeout=%g,entry_timeout=%g,use_ino,max_read=%u",
+                 options.attr_timeout, options.entry_timeout,
+                 options.max_read);
+    }
+    assert(fuse_opt_insert_arg(&args, 1, mountOpts) == 0);
+
+    /* Inherited by every thread, so only stats_main receives it. */
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (options.capture && (options.lowlevel || options.replay)) {
+        fprintf(stderr, "--capture works only when mounting with the "
+                "path-based interface\n");
+        return 1;
+    }
+
+    op_stats_set = stats_set_new(sizeof(struct sfs_op_stats));
+    if (options.trace || options.verbose) {
+        trace_open(options.trace);
+    }
+    if (options.capture) {
+        capture_open(options.capture);
+    }
+
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+    if (options.writeback_cache) {
+        fprintf(stderr, "This libfuse has no writeback cache, ignoring "
+                "--writeback-cache\n");
+    }
+#endif
+
+    if (options.io && disk_set_backend(options.io) != 0) {
+        fprintf(stderr, "Unknown I/O backend '%s'\n", options.io);
+        return 1;
+    }
+
+    disk_cache_init((size_t)options.cache_mb << 20, options.writeback);
     disk_open_image(options.img);
+    blocktbl_load();
+    alloc_init();
+    dir_usage_init();
+
+    if (options.replay) {
+        return replay_main(options.replay);
+    }
+    if (options.lowlevel) {
+        return ll_main(&args);
+    }
 
     return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
 }
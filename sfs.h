@@ -2,6 +2,7 @@
 #define SFS_H
 
 #include <stdint.h>
+#include <sys/ioctl.h>
 
 /*
  * This file defines all data structures and other information about the SFS
@@ -77,4 +78,28 @@ struct sfs_entry {
     uint32_t size;
 } __attribute__((__packed__));
 
+/*
+ * ioctl of the driver to copy data between two files within the image, as
+ * copy_file_range does: issued on an open file descriptor of the destination,
+ * which must be open for writing, with the path of the source relative to the
+ * root of the mount. On return `length` holds the number of bytes copied,
+ * which is less than requested at the end of the source file.
+ *
+ * The data does not pass through the kernel, so its caches of the destination
+ * go stale. With the low-level interface the driver invalidates them. The
+ * path-based one cannot, so there the destination should be opened with
+ * O_TRUNC and ftruncate()d to its final size after the copy, which makes the
+ * kernel fetch the new size and drop the pages it cached (see sfscp.py).
+ */
+#define SFS_COPY_PATH_MAX   1024u
+
+struct sfs_copy_range {
+    char src_path[SFS_COPY_PATH_MAX];
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t length;
+};
+
+#define SFS_IOC_COPY_RANGE  _IOWR('S', 1, struct sfs_copy_range)
+
 #endif
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+import argparse
+import fcntl
+import os
+import shutil
+import struct
+import sys
+
+
+# Must match struct sfs_copy_range and SFS_IOC_COPY_RANGE in sfs.h.
+COPY_PATH_MAX = 1024
+COPY_RANGE = struct.Struct('=%dsQQQ' % COPY_PATH_MAX)
+IOC_COPY_RANGE = (3 << 30) | (COPY_RANGE.size << 16) | (ord('S') << 8) | 1
+
+
+class CopyError(Exception):
+    pass
+
+
+def mount_root(path):
+    """The mountpoint of the file system that `path` is on."""
+    path = os.path.realpath(path)
+    while not os.path.ismount(path):
+        path = os.path.dirname(path)
+    return path
+
+
+def sfs_copy(src, dst):
+    """
+    Copy file `src` to `dst` within one SFS mount, with a single request to
+    the driver: the data is copied inside the image and never passes through
+    this process. Raises CopyError if the driver cannot do the copy.
+    """
+    root = mount_root(os.path.dirname(os.path.abspath(dst)) or '.')
+    if mount_root(src) != root:
+        raise CopyError('%s and %s are not on the same mount' % (src, dst))
+
+    src_path = '/' + os.path.relpath(os.path.realpath(src), root)
+    encoded = src_path.encode()
+    if len(encoded) >= COPY_PATH_MAX:
+        raise CopyError('Path too long: %s' % src_path)
+
+    size = os.stat(src).st_size
+    fd = os.open(dst, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+    try:
+        # Larger than fcntl.ioctl allows for an immutable argument.
+        arg = bytearray(COPY_RANGE.pack(encoded, 0, 0, size))
+        try:
+            fcntl.ioctl(fd, IOC_COPY_RANGE, arg, True)
+        except OSError as e:
+            raise CopyError('%s: %s' % (dst, e.strerror))
+        res = COPY_RANGE.unpack(arg)
+        if res[3] != size:
+            raise CopyError('%s: copied %d of %d bytes' % (dst, res[3], size))
+        # The kernel still has the truncated file cached; changing the size
+        # through it makes it drop those pages and fetch the new size.
+        os.ftruncate(fd, size)
+    finally:
+        os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Copy a file within a mounted SFS image without reading '
+                    'and writing the data through the kernel, using the '
+                    'in-driver copy of the SFS driver.'
+    )
+    parser.add_argument(
+        'src',
+        help='file to copy',
+    )
+    parser.add_argument(
+        'dst',
+        help='file to create or overwrite, on the same mount',
+    )
+    parser.add_argument(
+        '-f',
+        '--fallback',
+        action='store_true',
+        help='do a normal copy if the driver cannot do it (e.g., the files '
+             'are not on the same SFS mount)',
+    )
+    args = parser.parse_args()
+
+    try:
+        sfs_copy(args.src, args.dst)
+    except OSError as e:
+        sys.stderr.write('%s\n' % e)
+        return 1
+    except CopyError as e:
+        if not args.fallback:
+            sys.stderr.write('%s\n' % e)
+            return 1
+        shutil.copyfile(args.src, args.dst)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+
+import argparse
+import struct
+import sys
+
+
+# Must match the header and struct trace_rec in sfs.c.
+TRACE_MAGIC = b'SFSTRACE'
+TRACE_VERSION = 1
+TRACE_DROPPED = 0x7fff
+TRACE_INO = 0x8000
+
+HEADER = struct.Struct('=III')
+RECORD = struct.Struct('=QQqIIiHH')
+
+
+class TraceError(Exception):
+    pass
+
+
+class Record:
+    def __init__(self, fields, op_names):
+        (self.start_ns, self.key, self.offset, self.dur_ns, self.size,
+         self.result, op, self.ring) = fields
+        self.by_ino = bool(op & TRACE_INO)
+        self.op = op & ~TRACE_INO
+        self.dropped = self.op == TRACE_DROPPED
+        if self.dropped:
+            self.name = 'dropped'
+        elif self.op < len(op_names):
+            self.name = op_names[self.op]
+        else:
+            self.name = 'op%d' % self.op
+
+
+    def format(self, t0):
+        if self.dropped:
+            return '[%u] dropped %u records' % (self.ring, self.size)
+        return '%12.6f [%u] %-8s %s=%016x offset=%d size=%u = %d (%.1f us)' \
+                % ((self.start_ns - t0) / 1e9, self.ring, self.name,
+                   'ino ' if self.by_ino else 'hash', self.key, self.offset,
+                   self.size, self.result, self.dur_ns / 1000.0)
+
+
+def read_trace(f):
+    """Read a trace file; returns the operation names and the records."""
+    if f.read(len(TRACE_MAGIC)) != TRACE_MAGIC:
+        raise TraceError('Not an SFS trace file')
+
+    hdr = f.read(HEADER.size)
+    if len(hdr) != HEADER.size:
+        raise TraceError('Truncated header')
+    version, recsize, nops = HEADER.unpack(hdr)
+    if version != TRACE_VERSION or recsize != RECORD.size:
+        raise TraceError('Unsupported trace version %d (record size %d)'
+                % (version, recsize))
+
+    op_names = []
+    for _ in range(nops):
+        name = b''
+        while True:
+            c = f.read(1)
+            if not c:
+                raise TraceError('Truncated header')
+            if c == b'\0':
+                break
+            name += c
+        op_names.append(name.decode())
+
+    records = []
+    while True:
+        data = f.read(RECORD.size)
+        if len(data) < RECORD.size:
+            # A trace of a driver that is still running may end mid-record.
+            break
+        records.append(Record(RECORD.unpack(data), op_names))
+    return op_names, records
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0
+    idx = min(len(samples) - 1, int(len(samples) * pct / 100.0))
+    return samples[idx]
+
+
+def print_summary(records, outfile):
+    by_op = {}
+    dropped = 0
+    for r in records:
+        if r.dropped:
+            dropped += r.size
+        else:
+            by_op.setdefault(r.name, []).append(r)
+
+    outfile.write('%-10s %9s %8s %12s %10s %10s %10s\n' % ('op', 'calls',
+        'errors', 'bytes', 'mean (us)', 'p50 (us)', 'p99 (us)'))
+    for name, recs in sorted(by_op.items()):
+        durs = sorted(r.dur_ns / 1000.0 for r in recs)
+        errors = sum(1 for r in recs if r.result < 0)
+        nbytes = sum(r.result for r in recs
+                     if r.result > 0 and name in ('read', 'write'))
+        outfile.write('%-10s %9d %8d %12d %10.1f %10.1f %10.1f\n' % (name,
+            len(recs), errors, nbytes, sum(durs) / len(durs),
+            percentile(durs, 50), percentile(durs, 99)))
+    if dropped:
+        outfile.write('%d records were dropped\n' % dropped)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Decode a trace written by the SFS driver with '
+                    '--trace=FILE.'
+    )
+    parser.add_argument(
+        'trace',
+        type=argparse.FileType('rb'),
+        help='trace file',
+    )
+    parser.add_argument(
+        '-s',
+        '--summary',
+        action='store_true',
+        help='print per-operation totals and latencies instead of the '
+             'records',
+    )
+    parser.add_argument(
+        '-o',
+        '--op',
+        action='append',
+        help='only show this operation (may be repeated)',
+    )
+    parser.add_argument(
+        '-r',
+        '--raw-order',
+        action='store_true',
+        help='keep the records in file order, instead of sorting them by '
+             'start time',
+    )
+    args = parser.parse_args()
+
+    try:
+        op_names, records = read_trace(args.trace)
+    except TraceError as e:
+        sys.stderr.write('%s\n' % e)
+        return 1
+
+    if args.op:
+        unknown = set(args.op) - set(op_names)
+        if unknown:
+            sys.stderr.write('Unknown operation(s): %s\n'
+                    % ', '.join(sorted(unknown)))
+            return 1
+        records = [r for r in records if r.dropped or r.name in args.op]
+
+    if args.summary:
+        print_summary(records, sys.stdout)
+        return 0
+
+    if not args.raw_order:
+        records.sort(key=lambda r: r.start_ns)
+    t0 = min((r.start_ns for r in records if not r.dropped), default=0)
+    try:
+        for r in records:
+            sys.stdout.write(r.format(t0) + '\n')
+    except BrokenPipeError:
+        pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())